@@ -0,0 +1,71 @@
+#!/bin/bash
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 SERVER_PORT FILE_IN [RUNS] [WINDOW] [BUFFER]"
+    echo "   ex: $0 5555 bigfile 5 64 1400"
+    exit 2
+fi
+
+# ===============================
+APP_SERVER=./server
+APP_CLIENT=./rcopy
+SERVER=localhost
+# ===============================
+
+PORT=$1
+FILE=$2
+RUNS=${3:-5}
+WIN=${4:-64}
+SIZE=${5:-1400}
+ERROR=0    # no injected errors, GRO is off while errors are injected
+
+FILE_BYTES=`stat -c %s $FILE`
+PACKETS=$(( (FILE_BYTES + SIZE) / SIZE ))
+OUTDIR=`mktemp -d`
+SERV_PID=
+
+function clean_up {
+    if [ -n "$SERV_PID" ]; then
+        kill -s KILL $SERV_PID &> /dev/null
+    fi
+    rm -rf $OUTDIR
+    exit
+}
+
+trap clean_up SIGHUP SIGINT SIGTERM SIGQUIT
+
+# ===============================
+# Receive rate and rcopy CPU time per byte over RUNS transfers, with and without UDP GRO
+
+echo "========== BENCH ==========="
+echo "File: $FILE ($FILE_BYTES bytes, $PACKETS packets) Runs: $RUNS Window: $WIN Buffer: $SIZE"
+printf "%8s %10s %12s %10s %12s %8s\n" "GRO" "Seconds" "Packets/s" "CPU s" "CPU ns/byte" "Correct"
+
+$APP_SERVER $ERROR $PORT &> /dev/null &
+SERV_PID=$!
+sleep 1
+
+TIMEFORMAT="%U %S"
+for GRO in on off; do
+    CPU=0
+    CORRECT=0
+    START=`date +%s.%N`
+    for i in `seq 1 $RUNS`; do
+        TIMES=`{ time NETWORK_GRO=$GRO $APP_CLIENT $OUTDIR/out $FILE $WIN $SIZE $ERROR $SERVER $PORT &> /dev/null ; } 2>&1`
+        CPU=`echo "$CPU $TIMES" | awk '{ print $1 + $2 + $3 }'`
+        if cmp -s $FILE $OUTDIR/out; then
+            CORRECT=$((CORRECT + 1))
+        fi
+        rm -f $OUTDIR/out
+    done
+    END=`date +%s.%N`
+
+    awk -v g=$GRO -v s=$START -v e=$END -v b=$FILE_BYTES -v p=$PACKETS -v r=$RUNS -v cpu=$CPU -v ok=$CORRECT \
+        'BEGIN { t = e - s; printf "%8s %10.3f %12.0f %10.3f %12.3f %5d/%d\n", g, t, (p * r) / t, cpu, (cpu * 1000000000) / (b * r), ok, r }'
+done
+
+kill -s KILL $SERV_PID &> /dev/null
+wait $SERV_PID &> /dev/null
+SERV_PID=
+
+clean_up
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 SERVER_PORT FILE_IN [CLIENTS] [WORKER_COUNTS] [WINDOW] [BUFFER]"
+    echo "   ex: $0 5555 bigfile 16 \"1 2 4 8\" 64 1400"
+    exit 2
+fi
+
+# ===============================
+APP_SERVER=./server
+APP_CLIENT=./rcopy
+SERVER=localhost
+# ===============================
+
+PORT=$1
+FILE=$2
+CLIENTS=${3:-16}
+WORKER_COUNTS=${4:-"1 2 4 8"}
+WIN=${5:-64}
+SIZE=${6:-1400}
+ERROR=0    # no injected errors, this measures goodput
+
+FILE_BYTES=`stat -c %s $FILE`
+OUTDIR=`mktemp -d`
+SERV_PID=
+
+function clean_up {
+    if [ -n "$SERV_PID" ]; then
+        kill -s KILL $SERV_PID &> /dev/null
+    fi
+    rm -rf $OUTDIR
+    exit
+}
+
+trap clean_up SIGHUP SIGINT SIGTERM SIGQUIT
+
+# ===============================
+# Aggregate goodput of CLIENTS concurrent transfers for each worker count
+
+echo "========== BENCH ==========="
+echo "File: $FILE ($FILE_BYTES bytes) Clients: $CLIENTS Window: $WIN Buffer: $SIZE"
+printf "%8s %10s %12s %8s\n" "Workers" "Seconds" "Goodput Mb/s" "Correct"
+
+for WORKERS in $WORKER_COUNTS; do
+    $APP_SERVER $ERROR $PORT $WORKERS &> /dev/null &
+    SERV_PID=$!
+    sleep 1
+
+    START=`date +%s.%N`
+    CLIENT_PIDS=
+    for i in `seq 1 $CLIENTS`; do
+        $APP_CLIENT $OUTDIR/out.$i $FILE $WIN $SIZE $ERROR $SERVER $PORT &> /dev/null &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    wait $CLIENT_PIDS
+    END=`date +%s.%N`
+
+    kill -s KILL $SERV_PID &> /dev/null
+    wait $SERV_PID &> /dev/null
+    SERV_PID=
+
+    CORRECT=0
+    for i in `seq 1 $CLIENTS`; do
+        if cmp -s $FILE $OUTDIR/out.$i; then
+            CORRECT=$((CORRECT + 1))
+        fi
+    done
+    rm -f $OUTDIR/out.*
+
+    awk -v w=$WORKERS -v s=$START -v e=$END -v b=$FILE_BYTES -v c=$CLIENTS -v ok=$CORRECT \
+        'BEGIN { t = e - s; printf "%8d %10.3f %12.1f %5d/%d\n", w, t, (b * c * 8) / (t * 1000000), ok, c }'
+done
+
+clean_up
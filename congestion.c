@@ -0,0 +1,324 @@
+// Congestion control for the server's send window
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "networks.h"
+#include "congestion.h"
+
+#define PACING_SS_GAIN 2.0
+#define PACING_CA_GAIN 1.2
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+#define BBR_HIGH_GAIN 2.885
+#define BBR_CWND_GAIN 2.0
+#define BBR_MIN_WINDOW 4
+
+static const double bbrProbeGains[BBR_GAIN_CYCLE] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+/* AIMD: slow start up to ssthresh, then one packet per window of acks, halve on loss */
+static void aimdAck(Congestion *cc, uint32_t acked, int64_t now)
+{
+   (void) now;
+
+   if (cc->cwnd < cc->ssthresh)
+   {
+      cc->cwnd += acked;
+   }
+   else
+   {
+      cc->cwnd += acked / cc->cwnd;
+   }
+}
+
+static void aimdLoss(Congestion *cc, int isTimeout, int64_t now)
+{
+   (void) now;
+
+   cc->ssthresh = cc->cwnd / 2 > CC_MIN_WINDOW ? cc->cwnd / 2 : CC_MIN_WINDOW;
+   cc->cwnd = isTimeout ? 1 : cc->ssthresh;
+}
+
+/* CUBIC (RFC 8312): the window follows a cubic curve in time since the last loss, centred on
+   the window where that loss happened, and never grows slower than Reno would */
+static void cubicAck(Congestion *cc, uint32_t acked, int64_t now)
+{
+   double t;
+   double target;
+
+   if (cc->cwnd < cc->ssthresh)
+   {
+      cc->cwnd += acked;
+      return;
+   }
+
+   if (cc->cubic.epochStart == 0)
+   {
+      cc->cubic.epochStart = now;
+      if (cc->cwnd < cc->cubic.wMax)
+      {
+         cc->cubic.k = cbrt((cc->cubic.wMax - cc->cwnd) / CUBIC_C);
+         cc->cubic.origin = cc->cubic.wMax;
+      }
+      else
+      {
+         cc->cubic.k = 0;
+         cc->cubic.origin = cc->cwnd;
+      }
+      cc->cubic.renoCwnd = cc->cwnd;
+   }
+
+   t = (now - cc->cubic.epochStart + cc->minRtt) / 1000000.0 - cc->cubic.k;
+   target = cc->cubic.origin + CUBIC_C * t * t * t;
+
+   cc->cubic.renoCwnd += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+   if (cc->cubic.renoCwnd > target)
+   {
+      target = cc->cubic.renoCwnd;
+   }
+
+   if (target > cc->cwnd)
+   {
+      cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+   }
+   else
+   {
+      cc->cwnd += 0.01 * acked / cc->cwnd;
+   }
+}
+
+static void cubicLoss(Congestion *cc, int isTimeout, int64_t now)
+{
+   (void) now;
+
+   /* Fast convergence: give up bandwidth sooner when the last loss came at a smaller window */
+   if (cc->cwnd < cc->cubic.wLastMax)
+   {
+      cc->cubic.wLastMax = cc->cwnd;
+      cc->cubic.wMax = cc->cwnd * (1 + CUBIC_BETA) / 2;
+   }
+   else
+   {
+      cc->cubic.wLastMax = cc->cwnd;
+      cc->cubic.wMax = cc->cwnd;
+   }
+   cc->cubic.epochStart = 0;
+   cc->ssthresh = cc->cwnd * CUBIC_BETA > CC_MIN_WINDOW ? cc->cwnd * CUBIC_BETA : CC_MIN_WINDOW;
+   cc->cwnd = isTimeout ? 1 : cc->ssthresh;
+}
+
+/* BBR-like: model the path as bottleneck bandwidth (max delivery rate over the last rounds)
+   times minimum RTT and keep a couple of those in flight, ignoring random loss */
+static void bbrInit(Congestion *cc)
+{
+   cc->bbr.state = BBR_STARTUP;
+   cc->bbr.pacingGain = BBR_HIGH_GAIN;
+}
+
+/* One round trip has passed: take a delivery rate sample and move through the phases */
+static void bbrRound(Congestion *cc, int64_t now)
+{
+   int i;
+   double rate = (double) (cc->bbr.delivered - cc->bbr.roundDelivered) / (now - cc->bbr.roundStart);
+
+   cc->bbr.bwSamples[cc->bbr.bwIndex++ % BBR_BW_ROUNDS] = rate;
+   cc->bbr.btlBw = 0;
+   for (i = 0; i < BBR_BW_ROUNDS; i++)
+   {
+      if (cc->bbr.bwSamples[i] > cc->bbr.btlBw)
+      {
+         cc->bbr.btlBw = cc->bbr.bwSamples[i];
+      }
+   }
+   cc->bbr.roundStart = now;
+   cc->bbr.roundDelivered = cc->bbr.delivered;
+
+   switch (cc->bbr.state)
+   {
+      case BBR_STARTUP: /* The pipe is full once three rounds in a row grow bandwidth less than 25% */
+      {
+         if (cc->bbr.btlBw >= 1.25 * cc->bbr.fullBw)
+         {
+            cc->bbr.fullBw = cc->bbr.btlBw;
+            cc->bbr.fullBwRounds = 0;
+         }
+         else if (++(cc->bbr.fullBwRounds) >= 3)
+         {
+            cc->bbr.state = BBR_DRAIN;
+            cc->bbr.pacingGain = 1 / BBR_HIGH_GAIN;
+         }
+         break;
+      }
+      case BBR_DRAIN: /* One round to drain the queue startup built */
+      {
+         cc->bbr.state = BBR_PROBE_BW;
+         cc->bbr.cycleIndex = 0;
+         cc->bbr.pacingGain = bbrProbeGains[0];
+         break;
+      }
+      default: /* Probe for more bandwidth one round, drain the next, then cruise */
+      {
+         cc->bbr.cycleIndex = (cc->bbr.cycleIndex + 1) % BBR_GAIN_CYCLE;
+         cc->bbr.pacingGain = bbrProbeGains[cc->bbr.cycleIndex];
+      }
+   }
+}
+
+static void bbrAck(Congestion *cc, uint32_t acked, int64_t now)
+{
+   double bdp;
+
+   cc->bbr.delivered += acked;
+   if (cc->bbr.roundStart == 0)
+   {
+      cc->bbr.roundStart = now;
+      cc->bbr.roundDelivered = cc->bbr.delivered - acked;
+   }
+   else if (cc->minRtt > 0 && now - cc->bbr.roundStart >= cc->minRtt)
+   {
+      bbrRound(cc, now);
+   }
+
+   /* Startup grows like slow start until the model knows the pipe, after that the window is the model */
+   bdp = cc->bbr.btlBw * cc->minRtt;
+   if (cc->bbr.state == BBR_STARTUP)
+   {
+      cc->cwnd += acked;
+   }
+   else
+   {
+      cc->cwnd = BBR_CWND_GAIN * bdp > BBR_MIN_WINDOW ? BBR_CWND_GAIN * bdp : BBR_MIN_WINDOW;
+   }
+}
+
+/* Pace at the bottleneck bandwidth scaled by the phase's gain, startup has no estimate to go on yet */
+static double bbrPacingRate(Congestion *cc, int64_t srtt)
+{
+   if (cc->bbr.btlBw > 0)
+   {
+      return cc->bbr.pacingGain * cc->bbr.btlBw;
+   }
+   return srtt > 0 ? BBR_HIGH_GAIN * congestionWindow(cc) / srtt : 0;
+}
+
+static void bbrLoss(Congestion *cc, int isTimeout, int64_t now)
+{
+   (void) now;
+
+   /* Only a timeout says the model is wrong, fall back to a small window until acks flow again */
+   if (isTimeout && cc->cwnd > BBR_MIN_WINDOW)
+   {
+      cc->cwnd = BBR_MIN_WINDOW;
+   }
+}
+
+static const CongestionOps congestionTable[] = {
+   {"aimd", NULL, aimdAck, aimdLoss, NULL, NULL},
+   {"cubic", NULL, cubicAck, cubicLoss, NULL, NULL},
+   {"bbr", bbrInit, bbrAck, bbrLoss, NULL, bbrPacingRate},
+};
+
+/* Look up a controller by name, NULL if there is none */
+const CongestionOps *findCongestion(const char *name)
+{
+   size_t i;
+
+   for (i = 0; i < sizeof(congestionTable) / sizeof(congestionTable[0]); i++)
+   {
+      if (strcmp(congestionTable[i].name, name) == 0)
+      {
+         return &(congestionTable[i]);
+      }
+   }
+   return NULL;
+}
+
+/* Start a controller for a window of at most maxWindow packets */
+void initCongestion(Congestion *cc, const CongestionOps *ops, int maxWindow)
+{
+   memset(cc, 0, sizeof(Congestion));
+   cc->ops = ops;
+   cc->maxWindow = maxWindow;
+   cc->cwnd = CC_INITIAL_WINDOW;
+   cc->ssthresh = maxWindow;
+   if (ops->init != NULL)
+   {
+      ops->init(cc);
+   }
+}
+
+/* Packets allowed in flight right now, between one and the negotiated window */
+int congestionWindow(Congestion *cc)
+{
+   if (cc->cwnd < 1)
+   {
+      return 1;
+   }
+   if (cc->cwnd > cc->maxWindow)
+   {
+      return cc->maxWindow;
+   }
+   return (int) cc->cwnd;
+}
+
+/* An RR acknowledged this many new packets */
+void congestionAck(Congestion *cc, uint32_t acked, int64_t now)
+{
+   cc->ops->onAck(cc, acked, now);
+
+   /* Growing past the window the client allows would only mean a burst once acks stop being the limit */
+   if (cc->cwnd > cc->maxWindow)
+   {
+      cc->cwnd = cc->maxWindow;
+   }
+}
+
+/* A packet was lost (SREJ) or the RTO ran out; losses sent before the last reaction are the same event */
+void congestionLoss(Congestion *cc, uint32_t sequence, uint32_t nextSequence, int isTimeout, int64_t now)
+{
+   if (!isTimeout && sequence < cc->recoverUntil)
+   {
+      return;
+   }
+   cc->recoverUntil = nextSequence;
+   cc->ops->onLoss(cc, isTimeout, now);
+}
+
+/* A new RTT sample, the minimum is kept for a while so a route change eventually shows up */
+void congestionRtt(Congestion *cc, int64_t rtt, int64_t now)
+{
+   if (cc->minRtt == 0 || rtt <= cc->minRtt || now - cc->minRttStamp > CC_MIN_RTT_WINDOW_USEC)
+   {
+      cc->minRtt = rtt > 0 ? rtt : 1;
+      cc->minRttStamp = now;
+   }
+   cc->lastRtt = rtt;
+   if (cc->ops->onRttSample != NULL)
+   {
+      cc->ops->onRttSample(cc, rtt, now);
+   }
+}
+
+/* Rate to pace packets of the given size at in bytes per second, 0 until there is an RTT to base it on.
+   Window-based controllers send a window per SRTT, with headroom so pacing never becomes the limit */
+int64_t congestionPacingRate(Congestion *cc, int64_t srtt, int packetSize)
+{
+   double rate = 0;
+
+   if (cc->ops->pacingRate != NULL)
+   {
+      rate = cc->ops->pacingRate(cc, srtt);
+   }
+   else if (srtt > 0)
+   {
+      rate = (cc->cwnd < cc->ssthresh ? PACING_SS_GAIN : PACING_CA_GAIN) * congestionWindow(cc) / srtt;
+   }
+   return (int64_t) (rate * packetSize * 1000000);
+}
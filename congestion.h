@@ -0,0 +1,76 @@
+// Congestion control for the server's send window
+//
+// Every session owns a Congestion driven through a table of callbacks picked by
+// name at setup (the client asks for one in its setup packet). The controller
+// only limits how much of the negotiated window may be in flight; it never grows
+// past what the client asked for. Windows are in packets, times in microseconds.
+// The controller also sets the rate the server paces packets out at.
+
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+#include <stdint.h>
+
+#define CC_NAME_LEN 16
+#define CC_DEFAULT "cubic"
+#define CC_INITIAL_WINDOW 10
+#define CC_MIN_WINDOW 2
+#define CC_MIN_RTT_WINDOW_USEC 10000000
+
+#define BBR_BW_ROUNDS 10
+#define BBR_GAIN_CYCLE 8
+
+typedef struct congestion Congestion;
+
+typedef struct congestionOps {
+   const char *name;
+   void (*init)(Congestion *cc);
+   void (*onAck)(Congestion *cc, uint32_t acked, int64_t now);
+   void (*onLoss)(Congestion *cc, int isTimeout, int64_t now);
+   void (*onRttSample)(Congestion *cc, int64_t rtt, int64_t now);
+   double (*pacingRate)(Congestion *cc, int64_t srtt);
+} CongestionOps;
+
+struct congestion {
+   const CongestionOps *ops;
+   double cwnd;
+   double ssthresh;
+   int maxWindow;
+   uint32_t recoverUntil;
+   int64_t minRtt;
+   int64_t minRttStamp;
+   int64_t lastRtt;
+   union {
+      struct {
+         double wMax;
+         double wLastMax;
+         double k;
+         double origin;
+         double renoCwnd;
+         int64_t epochStart;
+      } cubic;
+      struct {
+         int state;
+         double btlBw;
+         double bwSamples[BBR_BW_ROUNDS];
+         int bwIndex;
+         double fullBw;
+         int fullBwRounds;
+         uint64_t delivered;
+         uint64_t roundDelivered;
+         int64_t roundStart;
+         int cycleIndex;
+         double pacingGain;
+      } bbr;
+   };
+};
+
+const CongestionOps *findCongestion(const char *name);
+void initCongestion(Congestion *cc, const CongestionOps *ops, int maxWindow);
+int congestionWindow(Congestion *cc);
+void congestionAck(Congestion *cc, uint32_t acked, int64_t now);
+void congestionLoss(Congestion *cc, uint32_t sequence, uint32_t nextSequence, int isTimeout, int64_t now);
+void congestionRtt(Congestion *cc, int64_t rtt, int64_t now);
+int64_t congestionPacingRate(Congestion *cc, int64_t srtt, int packetSize);
+
+#endif
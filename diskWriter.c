@@ -0,0 +1,205 @@
+// Disk writer thread for rcopy, fed through a single-producer/single-consumer ring
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "networks.h"
+#include "diskWriter.h"
+
+/* Records start on a boundary of their header's size, so a header always fits before the end of the ring */
+static uint64_t recordSize(int len)
+{
+   return (sizeof(WriteRecord) + len + sizeof(WriteRecord) - 1) / sizeof(WriteRecord) * sizeof(WriteRecord);
+}
+
+/* Wake the other side if it went to sleep (checked after the head or tail moved, so no wakeup is lost) */
+static void wakeSide(DiskWriter *writer, _Atomic int *isWaiting)
+{
+   if (atomic_load(isWaiting))
+   {
+      pthread_mutex_lock(&(writer->lock));
+      pthread_cond_broadcast(&(writer->cond));
+      pthread_mutex_unlock(&(writer->lock));
+   }
+}
+
+/* Network loop: sleep until the writer has freed enough of the ring */
+static void waitForSpace(DiskWriter *writer, uint64_t needed)
+{
+   uint64_t head = atomic_load(&(writer->head));
+
+   if (WRITE_RING_BYTES - (head - atomic_load(&(writer->tail))) >= needed)
+   {
+      return;
+   }
+   pthread_mutex_lock(&(writer->lock));
+   atomic_store(&(writer->isLoopWaiting), TRUE);
+   while (WRITE_RING_BYTES - (head - atomic_load(&(writer->tail))) < needed)
+   {
+      pthread_cond_wait(&(writer->cond), &(writer->lock));
+   }
+   atomic_store(&(writer->isLoopWaiting), FALSE);
+   pthread_mutex_unlock(&(writer->lock));
+}
+
+/* Writer thread: write each published record to its place in the file until stopped and drained */
+static void *writeRecords(void *arg)
+{
+   DiskWriter *writer = arg;
+   uint64_t tail = atomic_load(&(writer->tail));
+   WriteRecord record;
+   ssize_t result;
+   int written;
+
+   while (1)
+   {
+      if (tail == atomic_load(&(writer->head)))
+      {
+         if (atomic_load(&(writer->isStopping)))
+         {
+            break;
+         }
+         pthread_mutex_lock(&(writer->lock));
+         atomic_store(&(writer->isWriterWaiting), TRUE);
+         while (tail == atomic_load(&(writer->head)) && !atomic_load(&(writer->isStopping)))
+         {
+            pthread_cond_wait(&(writer->cond), &(writer->lock));
+         }
+         atomic_store(&(writer->isWriterWaiting), FALSE);
+         pthread_mutex_unlock(&(writer->lock));
+         continue;
+      }
+
+      memcpy(&record, writer->ring + tail % WRITE_RING_BYTES, sizeof(WriteRecord));
+      if (record.len < 0)
+      {
+         tail += WRITE_RING_BYTES - tail % WRITE_RING_BYTES;
+      }
+      else
+      {
+         for (written = 0; written < record.len; written += result)
+         {
+            if ((result = pwrite(writer->file, writer->ring + tail % WRITE_RING_BYTES + sizeof(WriteRecord) + written,
+               record.len - written, record.offset + written)) < 0)
+            {
+               if (errno == EINTR)
+               {
+                  result = 0;
+                  continue;
+               }
+               perror("pwrite");
+               exit(-1);
+            }
+         }
+         tail += recordSize(record.len);
+      }
+      atomic_store(&(writer->tail), tail);
+      wakeSide(writer, &(writer->isLoopWaiting));
+   }
+   return NULL;
+}
+
+/* Start the writer thread for an open file */
+DiskWriter *startDiskWriter(int file)
+{
+   DiskWriter *writer;
+
+   if ((writer = calloc(1, sizeof(DiskWriter))) == NULL || (writer->ring = malloc(WRITE_RING_BYTES)) == NULL)
+   {
+      perror("malloc");
+      exit(-1);
+   }
+   writer->file = file;
+   pthread_mutex_init(&(writer->lock), NULL);
+   pthread_cond_init(&(writer->cond), NULL);
+   if (pthread_create(&(writer->thread), NULL, writeRecords, writer) != 0)
+   {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(-1);
+   }
+   return writer;
+}
+
+/* Copy data for the given file offset onto the ring. It joins the record being filled when it follows on from
+   it, otherwise that record is published first. Only blocks while the ring is full */
+void queueWrite(DiskWriter *writer, uint8_t *buf, int len, off_t offset)
+{
+   uint64_t head;
+   uint64_t left;
+   WriteRecord skip;
+
+   if (writer->openLen > 0 && (writer->openOffset + writer->openLen != offset || writer->openLen + len > WRITE_RECORD_MAX))
+   {
+      publishWrites(writer);
+   }
+
+   /* A new record gets room for the largest one up front, at the start of the ring if that is not left at the end */
+   if (writer->openLen == 0)
+   {
+      head = atomic_load(&(writer->head));
+      left = WRITE_RING_BYTES - head % WRITE_RING_BYTES;
+      if (left < recordSize(WRITE_RECORD_MAX))
+      {
+         waitForSpace(writer, left);
+         skip.offset = 0;
+         skip.len = -1;
+         memcpy(writer->ring + head % WRITE_RING_BYTES, &skip, sizeof(WriteRecord));
+         atomic_store(&(writer->head), head + left);
+         wakeSide(writer, &(writer->isWriterWaiting));
+      }
+      waitForSpace(writer, recordSize(WRITE_RECORD_MAX));
+      writer->openOffset = offset;
+      writer->openSince = getTimeUsec();
+   }
+
+   head = atomic_load(&(writer->head));
+   memcpy(writer->ring + head % WRITE_RING_BYTES + sizeof(WriteRecord) + writer->openLen, buf, len);
+   writer->openLen += len;
+}
+
+/* Hand the record being filled to the writer thread */
+void publishWrites(DiskWriter *writer)
+{
+   uint64_t head = atomic_load(&(writer->head));
+   WriteRecord record;
+
+   if (writer->openLen == 0)
+   {
+      return;
+   }
+   record.offset = writer->openOffset;
+   record.len = writer->openLen;
+   record.pad = 0;
+   memcpy(writer->ring + head % WRITE_RING_BYTES, &record, sizeof(WriteRecord));
+   writer->openLen = 0;
+   atomic_store(&(writer->head), head + recordSize(record.len));
+   wakeSide(writer, &(writer->isWriterWaiting));
+}
+
+/* Hand over the record being filled if it has waited at least maxAgeUsec, so a slow trickle still reaches the file */
+void publishStaleWrites(DiskWriter *writer, int64_t maxAgeUsec)
+{
+   if (writer->openLen > 0 && getTimeUsec() - writer->openSince >= maxAgeUsec)
+   {
+      publishWrites(writer);
+   }
+}
+
+/* Publish what is left, wait for the writer thread to get all of it to the file, then free everything */
+void stopDiskWriter(DiskWriter *writer)
+{
+   publishWrites(writer);
+   atomic_store(&(writer->isStopping), TRUE);
+   pthread_mutex_lock(&(writer->lock));
+   pthread_cond_broadcast(&(writer->cond));
+   pthread_mutex_unlock(&(writer->lock));
+   pthread_join(writer->thread, NULL);
+
+   pthread_mutex_destroy(&(writer->lock));
+   pthread_cond_destroy(&(writer->cond));
+   free(writer->ring);
+   free(writer);
+}
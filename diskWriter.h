@@ -0,0 +1,50 @@
+// Disk writer thread for rcopy, fed through a single-producer/single-consumer ring
+//
+// The network loop copies delivered data into records on a byte ring and moves
+// on; a writer thread pwrite()s each record to its offset in the file, so a
+// stalled disk never holds up an RR. Data for consecutive offsets is gathered
+// into one record until it is published. Head and tail are the only shared
+// state and are plain atomics; a side only sleeps when the ring is empty (the
+// writer) or full (the network loop, which bounds memory to the ring).
+
+#ifndef __DISK_WRITER_H__
+#define __DISK_WRITER_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define WRITE_RING_BYTES (8 << 20)
+#define WRITE_RECORD_MAX (256 << 10)
+
+/* Every record on the ring starts with where its data goes, a length of -1 skips to the start of the ring */
+typedef struct writeRecord {
+   int64_t offset;
+   int32_t len;
+   int32_t pad;
+} WriteRecord;
+
+typedef struct diskWriter {
+   int file;
+   uint8_t *ring;
+   _Atomic uint64_t head;
+   _Atomic uint64_t tail;
+   _Atomic int isStopping;
+   _Atomic int isWriterWaiting;
+   _Atomic int isLoopWaiting;
+   off_t openOffset;
+   int openLen;
+   int64_t openSince;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+} DiskWriter;
+
+DiskWriter *startDiskWriter(int file);
+void queueWrite(DiskWriter *writer, uint8_t *buf, int len, off_t offset);
+void publishWrites(DiskWriter *writer);
+void publishStaleWrites(DiskWriter *writer, int64_t maxAgeUsec);
+void stopDiskWriter(DiskWriter *writer);
+
+#endif
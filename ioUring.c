@@ -0,0 +1,633 @@
+// io_uring network engine used behind sendPacket() and receivePacket()
+//
+// Sends are copied into a slot and queued as IORING_OP_SENDMSG; nothing is
+// handed to the kernel until uringSubmit(), so a whole window goes out with one
+// io_uring_enter. Every watched socket has a multishot IORING_OP_RECVMSG armed
+// that lands datagrams in a registered provided-buffer ring; completions are
+// reaped into a small queue per socket that uringRecvfrom() drains.
+//
+// uringSetup() returns FALSE on kernels (or builds) without what this needs,
+// and the caller keeps using the plain socket calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include "networks.h"
+#include "ioUring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#endif
+
+/* Multishot receives into a provided-buffer ring (and struct io_uring_recvmsg_out) arrived with the 6.0 uapi
+   headers. IORING_REGISTER_PBUF_RING is an enum there, so the multishot flag stands in for all of them, and
+   older headers build the stub below */
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+
+#define URING_SEND 1
+#define URING_RECV 2
+#define URING_CANCEL 3
+
+/* user_data carries the request kind, a generation and a slot index or socket number */
+#define USER_DATA(kind, gen, index) (((uint64_t) (kind) << 56) | ((uint64_t) ((gen) & 0xffffff) << 32) | (uint32_t) (index))
+#define USER_KIND(data) ((int) ((data) >> 56))
+#define USER_GEN(data) ((uint32_t) ((data) >> 32) & 0xffffff)
+#define USER_INDEX(data) ((uint32_t) (data))
+
+#define BUFFER_GROUP 0
+
+/* One queued datagram waiting to be sent */
+typedef struct sendSlot {
+   struct msghdr msg;
+   struct iovec iov;
+   struct sockaddr_in6 addr;
+   uint8_t data[MAX_BUF];
+} SendSlot;
+
+/* A socket with a multishot receive armed and the datagrams reaped for it */
+typedef struct watch {
+   int socketNum;
+   uint32_t id;
+   int isArmed;
+   int isBroken;
+   struct msghdr msg;
+   uint16_t bufferIds[URING_BUFFERS];
+   int head;
+   int count;
+} Watch;
+
+typedef struct ring {
+   int fd;
+   unsigned sqEntries;
+   unsigned *sqHead;
+   unsigned *sqTail;
+   unsigned *sqMask;
+   unsigned *sqArray;
+   unsigned sqLocalTail;
+   struct io_uring_sqe *sqes;
+   size_t sqesSize;
+   unsigned *cqHead;
+   unsigned *cqTail;
+   unsigned *cqMask;
+   struct io_uring_cqe *cqes;
+   void *sqMap;
+   size_t sqMapSize;
+   void *cqMap;
+   size_t cqMapSize;
+
+   struct io_uring_buf_ring *bufRing;
+   uint8_t *buffers;
+   uint16_t bufTail;
+
+   SendSlot *slots;
+   int *freeSlots;
+   int numFree;
+
+   Watch **watches;
+   int maxWatches;
+   int numUnarmed;
+   uint32_t nextId;
+} Ring;
+
+static __thread Ring *ring = NULL;
+
+/* Undo a uringSetup() that failed part way, whatever of the ring it got is released */
+static int abandonRing(Ring *newRing)
+{
+   if (newRing->bufRing != NULL && newRing->bufRing != MAP_FAILED)
+   {
+      munmap(newRing->bufRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+   }
+   if (newRing->sqes != NULL && newRing->sqes != MAP_FAILED)
+   {
+      munmap(newRing->sqes, newRing->sqesSize);
+   }
+   if (newRing->sqMap != NULL && newRing->sqMap != MAP_FAILED)
+   {
+      munmap(newRing->sqMap, newRing->sqMapSize);
+   }
+   close(newRing->fd);
+   free(newRing->buffers);
+   free(newRing->slots);
+   free(newRing->freeSlots);
+   free(newRing);
+   return FALSE;
+}
+
+static int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize)
+{
+   return syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+/* Grab the next free submission entry, submitting what is queued if the ring is full */
+static struct io_uring_sqe *getSqe()
+{
+   unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+   if (ring->sqLocalTail - head >= ring->sqEntries)
+   {
+      uringSubmit();
+      head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+      if (ring->sqLocalTail - head >= ring->sqEntries)
+      {
+         return NULL;
+      }
+   }
+
+   unsigned index = ring->sqLocalTail & *(ring->sqMask);
+   struct io_uring_sqe *sqe = &(ring->sqes[index]);
+   memset(sqe, 0, sizeof(*sqe));
+   ring->sqArray[index] = index;
+   ring->sqLocalTail++;
+   return sqe;
+}
+
+/* Give a receive buffer back to the kernel */
+static void recycleBuffer(uint16_t bufferId)
+{
+   struct io_uring_buf *buf = &(ring->bufRing->bufs[ring->bufTail & (URING_BUFFERS - 1)]);
+   buf->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bufferId * URING_BUFFER_SIZE);
+   buf->len = URING_BUFFER_SIZE;
+   buf->bid = bufferId;
+   ring->bufTail++;
+   __atomic_store_n(&(ring->bufRing->tail), ring->bufTail, __ATOMIC_RELEASE);
+}
+
+static Watch *findWatch(int socketNum)
+{
+   if (ring == NULL || socketNum < 0 || socketNum >= ring->maxWatches)
+   {
+      return NULL;
+   }
+   return ring->watches[socketNum];
+}
+
+/* Queue the multishot receive for a socket */
+static int armWatch(Watch *watch)
+{
+   struct io_uring_sqe *sqe;
+
+   if ((sqe = getSqe()) == NULL)
+   {
+      return FALSE;
+   }
+   sqe->opcode = IORING_OP_RECVMSG;
+   sqe->fd = watch->socketNum;
+   sqe->addr = (uint64_t) (uintptr_t) &(watch->msg);
+   sqe->len = 1;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = BUFFER_GROUP;
+   sqe->user_data = USER_DATA(URING_RECV, watch->id, watch->socketNum);
+   watch->isArmed = TRUE;
+   return TRUE;
+}
+
+/* Move every completion out of the ring */
+static void reap()
+{
+   unsigned head = *(ring->cqHead);
+   unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+   for (; head != tail; head++)
+   {
+      struct io_uring_cqe *cqe = &(ring->cqes[head & *(ring->cqMask)]);
+      int kind = USER_KIND(cqe->user_data);
+      uint32_t index = USER_INDEX(cqe->user_data);
+
+      if (kind == URING_SEND)
+      {
+         ring->freeSlots[ring->numFree++] = index;
+
+         /* A failed send is fatal like a failed sendmsg(), only a full socket buffer drops the datagram */
+         if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EWOULDBLOCK)
+         {
+            errno = -(cqe->res);
+            perror("sendmsg: ");
+            exit(-1);
+         }
+      }
+      else if (kind == URING_RECV)
+      {
+         /* The generation tells a live watch apart from a closed one whose socket number was reused */
+         Watch *watch = findWatch(index);
+         if (watch != NULL && watch->id != USER_GEN(cqe->user_data))
+         {
+            watch = NULL;
+         }
+
+         if (cqe->flags & IORING_CQE_F_BUFFER)
+         {
+            uint16_t bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            /* Queue it for the socket, or drop it like a full socket buffer would */
+            if (watch != NULL && cqe->res > 0 && watch->count < URING_BUFFERS)
+            {
+               int slot = (watch->head + watch->count) % URING_BUFFERS;
+               watch->bufferIds[slot] = bufferId;
+               watch->count++;
+            }
+            else
+            {
+               recycleBuffer(bufferId);
+            }
+         }
+
+         /* The multishot receive ended, rearm it unless the kernel cannot do it at all */
+         if (watch != NULL && !(cqe->flags & IORING_CQE_F_MORE))
+         {
+            watch->isArmed = FALSE;
+            ring->numUnarmed++;
+            if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            {
+               watch->isBroken = TRUE;
+            }
+         }
+      }
+   }
+   __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Set up this thread's ring, returns FALSE if io_uring cannot be used */
+int uringSetup()
+{
+   struct io_uring_params params;
+   struct io_uring_buf_reg reg;
+   Ring *newRing;
+   int i;
+
+   if (ring != NULL)
+   {
+      return TRUE;
+   }
+
+   if ((newRing = calloc(1, sizeof(Ring))) == NULL)
+   {
+      return FALSE;
+   }
+
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE;
+   params.cq_entries = URING_ENTRIES + URING_BUFFERS;
+   if ((newRing->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0)
+   {
+      free(newRing);
+      return FALSE;
+   }
+
+   /* Need one mmap for both rings and timeouts on io_uring_enter */
+   if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+   {
+      return abandonRing(newRing);
+   }
+
+   newRing->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   newRing->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   if (newRing->cqMapSize > newRing->sqMapSize)
+   {
+      newRing->sqMapSize = newRing->cqMapSize;
+   }
+   newRing->sqMap = mmap(NULL, newRing->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, newRing->fd, IORING_OFF_SQ_RING);
+   newRing->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+   newRing->sqes = mmap(NULL, newRing->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, newRing->fd, IORING_OFF_SQES);
+   if (newRing->sqMap == MAP_FAILED || newRing->sqes == MAP_FAILED)
+   {
+      return abandonRing(newRing);
+   }
+   newRing->cqMap = newRing->sqMap;
+
+   newRing->sqEntries = params.sq_entries;
+   newRing->sqHead = (unsigned *) ((uint8_t *) newRing->sqMap + params.sq_off.head);
+   newRing->sqTail = (unsigned *) ((uint8_t *) newRing->sqMap + params.sq_off.tail);
+   newRing->sqMask = (unsigned *) ((uint8_t *) newRing->sqMap + params.sq_off.ring_mask);
+   newRing->sqArray = (unsigned *) ((uint8_t *) newRing->sqMap + params.sq_off.array);
+   newRing->sqLocalTail = *(newRing->sqTail);
+   newRing->cqHead = (unsigned *) ((uint8_t *) newRing->cqMap + params.cq_off.head);
+   newRing->cqTail = (unsigned *) ((uint8_t *) newRing->cqMap + params.cq_off.tail);
+   newRing->cqMask = (unsigned *) ((uint8_t *) newRing->cqMap + params.cq_off.ring_mask);
+   newRing->cqes = (struct io_uring_cqe *) ((uint8_t *) newRing->cqMap + params.cq_off.cqes);
+
+   /* Register the provided buffer ring that multishot receives fill */
+   newRing->bufRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   newRing->buffers = malloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+   newRing->slots = malloc(params.sq_entries * sizeof(SendSlot));
+   newRing->freeSlots = malloc(params.sq_entries * sizeof(int));
+   if (newRing->bufRing == MAP_FAILED || newRing->buffers == NULL || newRing->slots == NULL || newRing->freeSlots == NULL)
+   {
+      return abandonRing(newRing);
+   }
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t) (uintptr_t) newRing->bufRing;
+   reg.ring_entries = URING_BUFFERS;
+   reg.bgid = BUFFER_GROUP;
+   if (syscall(__NR_io_uring_register, newRing->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+   {
+      return abandonRing(newRing);
+   }
+
+   ring = newRing;
+   for (i = 0; i < URING_BUFFERS; i++)
+   {
+      recycleBuffer(i);
+   }
+   for (i = 0; i < params.sq_entries; i++)
+   {
+      ring->freeSlots[ring->numFree++] = i;
+   }
+   ring->nextId = 1;
+
+   return TRUE;
+}
+
+int uringActive()
+{
+   return ring != NULL;
+}
+
+/* The ring's fd becomes readable when completions are waiting, so it can go in an epoll set */
+int uringFd()
+{
+   return ring != NULL ? ring->fd : -1;
+}
+
+/* Start receiving a socket's datagrams through the ring */
+int uringWatch(int socketNum)
+{
+   Watch *watch;
+
+   if (ring == NULL)
+   {
+      return FALSE;
+   }
+
+   if (socketNum >= ring->maxWatches)
+   {
+      int newMax = socketNum + 64;
+      if ((ring->watches = realloc(ring->watches, newMax * sizeof(Watch *))) == NULL)
+      {
+         perror("realloc");
+         exit(-1);
+      }
+      memset(ring->watches + ring->maxWatches, 0, (newMax - ring->maxWatches) * sizeof(Watch *));
+      ring->maxWatches = newMax;
+   }
+
+   if ((watch = calloc(1, sizeof(Watch))) == NULL)
+   {
+      perror("calloc");
+      exit(-1);
+   }
+   watch->socketNum = socketNum;
+   watch->id = ring->nextId++ & 0xffffff;
+   watch->msg.msg_namelen = sizeof(struct sockaddr_in6);
+   ring->watches[socketNum] = watch;
+
+   /* Submit right away so an old kernel's refusal shows up before anything depends on it */
+   if (!armWatch(watch) || uringSubmit() < 0 || watch->isBroken)
+   {
+      uringUnwatch(socketNum);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/* Stop receiving through the ring, call before closing the socket */
+void uringUnwatch(int socketNum)
+{
+   Watch *watch = findWatch(socketNum);
+   struct io_uring_sqe *sqe;
+
+   if (watch == NULL)
+   {
+      return;
+   }
+
+   if (watch->isArmed && (sqe = getSqe()) != NULL)
+   {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = USER_DATA(URING_RECV, watch->id, socketNum);
+      sqe->user_data = USER_DATA(URING_CANCEL, watch->id, socketNum);
+      uringSubmit();
+   }
+
+   for (; watch->count > 0; watch->count--, watch->head = (watch->head + 1) % URING_BUFFERS)
+   {
+      recycleBuffer(watch->bufferIds[watch->head]);
+   }
+   ring->watches[socketNum] = NULL;
+   free(watch);
+}
+
+/* Is this socket receiving through the ring */
+int uringWatching(int socketNum)
+{
+   return findWatch(socketNum) != NULL;
+}
+
+/* Are datagrams waiting for this socket */
+int uringReady(int socketNum)
+{
+   Watch *watch = findWatch(socketNum);
+   return watch != NULL && watch->count > 0;
+}
+
+/* Wait up to timeoutUsec (forever if negative) for a datagram on the socket */
+int uringWait(int socketNum, int64_t timeoutUsec)
+{
+   int64_t deadline = getTimeUsec() + timeoutUsec;
+   struct io_uring_getevents_arg arg;
+   struct __kernel_timespec ts;
+
+   uringSubmit();
+   while (!uringReady(socketNum))
+   {
+      int64_t left = deadline - getTimeUsec();
+      if (timeoutUsec >= 0 && left <= 0)
+      {
+         return FALSE;
+      }
+
+      memset(&arg, 0, sizeof(arg));
+      if (timeoutUsec >= 0)
+      {
+         ts.tv_sec = left / 1000000;
+         ts.tv_nsec = (left % 1000000) * 1000;
+         arg.ts = (uint64_t) (uintptr_t) &ts;
+      }
+      if (enter(0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR)
+      {
+         perror("io_uring_enter");
+         exit(-1);
+      }
+      uringSubmit();
+   }
+   return TRUE;
+}
+
+/* Queue a datagram, it goes out with the next uringSubmit() */
+int uringSendto(int socketNum, void *buf, int len, struct sockaddr *dstAddr, int addrLen)
+{
+   struct io_uring_sqe *sqe;
+   SendSlot *slot;
+   int index;
+
+   /* Every slot is in flight, wait for the kernel to finish one */
+   while (ring->numFree == 0)
+   {
+      uringSubmit();
+      if (ring->numFree == 0 && enter(0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      {
+         perror("io_uring_enter");
+         exit(-1);
+      }
+   }
+
+   if ((sqe = getSqe()) == NULL)
+   {
+      errno = EAGAIN;
+      return -1;
+   }
+
+   index = ring->freeSlots[--(ring->numFree)];
+   slot = &(ring->slots[index]);
+   memcpy(slot->data, buf, len);
+   memcpy(&(slot->addr), dstAddr, addrLen);
+   slot->iov.iov_base = slot->data;
+   slot->iov.iov_len = len;
+   memset(&(slot->msg), 0, sizeof(slot->msg));
+   slot->msg.msg_name = &(slot->addr);
+   slot->msg.msg_namelen = addrLen;
+   slot->msg.msg_iov = &(slot->iov);
+   slot->msg.msg_iovlen = 1;
+
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->fd = socketNum;
+   sqe->addr = (uint64_t) (uintptr_t) &(slot->msg);
+   sqe->len = 1;
+   sqe->user_data = USER_DATA(URING_SEND, 0, index);
+
+   return len;
+}
+
+/* Take the next datagram reaped for the socket, -1 with EAGAIN if there is none */
+int uringRecvfrom(int socketNum, void *buf, int len, int flags, struct sockaddr *srcAddr, int *addrLen)
+{
+   Watch *watch = findWatch(socketNum);
+   struct io_uring_recvmsg_out *out;
+   uint8_t *data;
+   int payloadLen;
+
+   if (watch == NULL)
+   {
+      errno = EBADF;
+      return -1;
+   }
+
+   if (watch->count == 0)
+   {
+      uringSubmit();
+   }
+
+   /* Blocking sockets wait for a datagram like recvfrom() would */
+   if (watch->count == 0 && !(fcntl(socketNum, F_GETFL, 0) & O_NONBLOCK))
+   {
+      uringWait(socketNum, -1);
+   }
+
+   if (watch->count == 0)
+   {
+      errno = EAGAIN;
+      return -1;
+   }
+
+   uint16_t bufferId = watch->bufferIds[watch->head];
+   data = ring->buffers + (size_t) bufferId * URING_BUFFER_SIZE;
+   out = (struct io_uring_recvmsg_out *) data;
+
+   /* Layout is the recvmsg_out header, the (fixed size) name, then the payload */
+   if (srcAddr != NULL)
+   {
+      int nameLen = out->namelen < watch->msg.msg_namelen ? out->namelen : watch->msg.msg_namelen;
+      memcpy(srcAddr, data + sizeof(*out), nameLen);
+      if (addrLen != NULL)
+      {
+         *addrLen = nameLen;
+      }
+   }
+   payloadLen = out->payloadlen < len ? out->payloadlen : len;
+   memcpy(buf, data + sizeof(*out) + watch->msg.msg_namelen + watch->msg.msg_controllen, payloadLen);
+
+   if (!(flags & MSG_PEEK))
+   {
+      watch->head = (watch->head + 1) % URING_BUFFERS;
+      watch->count--;
+      recycleBuffer(bufferId);
+   }
+
+   return payloadLen;
+}
+
+/* Hand every queued request to the kernel with one io_uring_enter and reap what finished */
+int uringSubmit()
+{
+   int i;
+   int result = 0;
+
+   if (ring == NULL)
+   {
+      return 0;
+   }
+
+   /* Rearm receives that ran out of buffers */
+   for (i = 0; ring->numUnarmed > 0 && i < ring->maxWatches; i++)
+   {
+      Watch *watch = ring->watches[i];
+      if (watch != NULL && !watch->isArmed && !watch->isBroken)
+      {
+         armWatch(watch);
+      }
+   }
+   ring->numUnarmed = 0;
+
+   unsigned toSubmit = ring->sqLocalTail - *(ring->sqTail);
+   __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+   if (toSubmit > 0)
+   {
+      while ((result = enter(toSubmit, 0, 0, NULL, 0)) < 0 && errno == EINTR);
+      if (result < 0)
+      {
+         perror("io_uring_enter");
+         exit(-1);
+      }
+   }
+   reap();
+
+   return result;
+}
+
+#else
+
+/* No io_uring on this platform (or headers too old for it), every call reports it is unavailable */
+int uringSetup() { return 0; }
+int uringActive() { return 0; }
+int uringFd() { return -1; }
+int uringWatch(int socketNum) { return 0; }
+void uringUnwatch(int socketNum) { }
+int uringWatching(int socketNum) { return 0; }
+int uringReady(int socketNum) { return 0; }
+int uringWait(int socketNum, int64_t timeoutUsec) { return 0; }
+int uringSendto(int socketNum, void *buf, int len, struct sockaddr *dstAddr, int addrLen) { errno = ENOSYS; return -1; }
+int uringRecvfrom(int socketNum, void *buf, int len, int flags, struct sockaddr *srcAddr, int *addrLen) { errno = ENOSYS; return -1; }
+int uringSubmit() { return 0; }
+
+#endif
@@ -0,0 +1,29 @@
+// io_uring network engine used behind sendPacket() and receivePacket()
+// Each thread owns its own ring; nothing is shared between threads.
+
+#ifndef __IO_URING_H__
+#define __IO_URING_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 2048
+
+int uringSetup();
+int uringActive();
+int uringFd();
+
+int uringWatch(int socketNum);
+void uringUnwatch(int socketNum);
+int uringWatching(int socketNum);
+int uringReady(int socketNum);
+int uringWait(int socketNum, int64_t timeoutUsec);
+
+int uringSendto(int socketNum, void *buf, int len, struct sockaddr *dstAddr, int addrLen);
+int uringRecvfrom(int socketNum, void *buf, int len, int flags, struct sockaddr *srcAddr, int *addrLen);
+int uringSubmit();
+
+#endif
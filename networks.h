@@ -18,13 +18,49 @@
 #include <pthread.h>
 #include <errno.h>
 
+#include "timerWheel.h"
+#include "congestion.h"
+#include "readAhead.h"
+
 #define BACKLOG 10
 #define MAX_BUF 1500
 #define MAX_DATA_BUF 1400
 #define MAX_THREADS 1000
+#define SEND_BATCH 64
+#define RECV_BATCH 64
+
+/* With UDP GRO on, each datagram received can hold up to 64 coalesced packets in 64 KB */
+#define GRO_BATCH 4
+#define GRO_MAX_SEGMENTS 64
+#define GRO_BUF 65536
+#define RECV_AREA (GRO_BATCH * GRO_BUF)
+#define RECV_MAX_PACKETS (GRO_BATCH * GRO_MAX_SEGMENTS)
+
+/* A UDP GSO send carries at most this many packets and must fit in one 64 KB datagram */
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
 
 #define TEN_SECONDS 10
 
+/* Timeouts in microseconds: resending control packets and giving up on a peer that has gone quiet */
+#define CONTROL_TIMEOUT_USEC 1000000
+#define IDLE_TIMEOUT_USEC 10000000
+
+/* Bounds on the retransmission timeout the server derives from measured RTT */
+#define RTO_INITIAL_USEC 1000000
+#define RTO_MIN_USEC 1000
+#define RTO_MAX_USEC 2000000
+
+/* The pacing token bucket holds this long at the pacing rate, but never less than a couple of packets */
+#define PACING_BURST_USEC 1000
+#define PACING_MIN_BURST 2
+
+/* How often a session checks back on a read-ahead chunk it is waiting for */
+#define READ_AHEAD_WAIT_USEC 1000
+
+/* A SACK's bitmap covers at most this many bytes' worth of packets past its RR */
+#define SACK_MAX_BYTES 1024
+
 #define SEND_CONNECTION 0
 #define SEND_FILENAME 1
 #define WAIT_ON_FILENAME_RESPONSE 2
@@ -52,10 +88,13 @@
 #define WAIT_FOR_ACK 21
 #define CHECK_FOR_ACK 22
 #define PROCESS_ACK 23
+#define WAIT_TO_SEND 24
+#define WAIT_FOR_FILE 25
 
 #define DATA_READY 0
 #define DATA_NOT_READY 1
-#define TRIES_FINISHED 2
+#define TIMED_OUT 2
+#define DATA_BLOCKED 3
 
 #define FLAG_1_SETUP 1
 #define FLAG_2_SETUP 2
@@ -66,6 +105,8 @@
 #define FLAG_8_BAD_FILENAME 8
 #define FLAG_9_END_CONNECTION 9
 #define FLAG_10_FINAL_DATA 10
+#define FLAG_11_FILE_SIZE 11
+#define FLAG_12_SACK 12
 
 #define TRUE 1
 #define FALSE 0
@@ -83,30 +124,153 @@ typedef struct __attribute__((__packed__)) connection {
    uint32_t len;
 } Connection;
 
-typedef struct __attribute__((__packed__)) packet {
-   uint8_t buf[MAX_BUF];
+/* What rcopy knows about the window above the next expected packet, one bit per slot: which packets are
+   already queued for their place in the file. The final and highest received sequences are -1 until seen */
+typedef struct receiveWindow {
+   uint8_t *received;
+   int64_t finalSequence;
+   int64_t highestReceived;
+} ReceiveWindow;
+
+/* A slot of the server's send window, the data is in the session's payload arena or the mapped file */
+typedef struct packetDesc {
+   uint8_t *data;
+   int64_t sentAt;
    uint32_t sequence;
-   uint8_t isSREJ;
-   Header header;
-} Packet;
+   uint32_t retransmits;
+   uint16_t length;
+   uint8_t flag;
+} PacketDesc;
+
+/* Sessions with something to do, linked through the sessions in the order they became runnable */
+typedef struct runQueue {
+   struct session *head;
+   struct session *tail;
+} RunQueue;
+
+/* Everything the server keeps for one client while the event loop drives its state machine */
+typedef struct session {
+   int socketNum;
+   struct sockaddr_in6 remote;
+   int state;
+   int file;
+   uint8_t *map;
+   off_t mapLen;
+   off_t mapOffset;
+   int64_t fileSize;
+   ReadAhead *readAhead;
+   int isErr;
+   int windowSize;
+   int bufferSize;
+   int currentRR;
+   uint8_t *resends;
+   int resendCount;
+   uint32_t resendFrom;
+   uint32_t currentPacket;
+   uint32_t currentPreparePacket;
+   int donePreparing;
+   int lastPacket;
+   int isReadable;
+   int isWaiting;
+   int isRunnable;
+   RunQueue *runQueue;
+   struct session *prevRunnable;
+   struct session *nextRunnable;
+   int64_t srtt;
+   int64_t rttvar;
+   int64_t rto;
+   uint32_t rttSamples;
+   uint32_t packetsSent;
+   uint32_t packetsResent;
+   uint32_t acksReceived;
+   Congestion cc;
+   int64_t rateCap;
+   int64_t pacingRate;
+   double tokens;
+   int64_t tokensAt;
+   Timer timer;
+   Timer idleTimer;
+   TimerWheel *timers;
+   int index;
+   int inboxLen;
+   PacketDesc *packets;
+   uint8_t *payloads;
+   uint8_t buf[MAX_BUF];
+   uint8_t inbox[MAX_BUF];
+} Session;
+
+/* Sessions of one worker hashed by client address, see sessionTable.h */
+typedef struct sessionTable {
+   Session **slots;
+   int capacity;
+   int count;
+} SessionTable;
+
+/* One event loop thread with its own listening socket and session table */
+typedef struct worker {
+   pthread_t thread;
+   int id;
+   int socketNum;
+   int handoffSocket;
+   int isHandoff;
+   int epollFd;
+   Session **sessions;
+   int numSessions;
+   int maxSessions;
+   SessionTable table;
+   RunQueue runnable;
+   TimerWheel timers;
+   int timerFd;
+   int64_t timerArmedAt;
+} Worker;
+
+/* Packets taken off the socket in one go, each points into area (RECV_AREA bytes) */
+typedef struct recvBatch {
+   uint8_t *area;
+   int count;
+   uint8_t *packets[RECV_MAX_PACKETS];
+   int32_t lens[RECV_MAX_PACKETS];
+} RecvBatch;
+
+/* A datagram handed from the listening process to a pre-forked worker (not packed, the address is used in place) */
+typedef struct handoff {
+   struct sockaddr_in6 remote;
+   int32_t len;
+   uint8_t buf[MAX_BUF];
+} Handoff;
 
 int safeRecv(int socketNum, void * buf, int len, int flags);
 int safeSend(int socketNum, void * buf, int len, int flags);
 int safeRecvfrom(int socketNum, void * buf, int len, int flags, struct sockaddr *srcAddr, int * addrLen);
 int safeSendto(int socketNum, void * buf, int len, int flags, struct sockaddr *srcAddr, int addrLen);
 
-int safeSelect(int socketNum, int seconds, int *triesLeft);
+int safeSelect(int socketNum, int64_t timeoutUsec);
+void setNonBlocking(int socketNum);
+void initErrors(float errorPercent);
+void guardPacketData();
+void initEngine();
+void watchSocket(int socketNum);
+void unwatchSocket(int socketNum);
+void flushPackets();
+int engineFd();
+int hasPacket(int socketNum);
+int64_t getTimeUsec();
+uint32_t hashAddress(struct sockaddr_in6 *addr);
 
 int32_t receivePacket(int socketNum, uint8_t *buf, struct sockaddr *srcAddr, int length);
+int32_t peekPacket(int socketNum, uint8_t *buf, struct sockaddr *srcAddr, int length);
+int enableGro(int socketNum);
+int receivePacketBatch(int socketNum, RecvBatch *batch, struct sockaddr *srcAddr, int length);
 Header createHeader(uint32_t sequence, uint8_t flag, uint16_t length);
 ssize_t sendHeader(int socketNum, uint32_t sequence, uint8_t flag, struct sockaddr *srcAddr, int addrLen);
 
 ssize_t sendPacket(int socketNum, uint32_t sequence, uint8_t flag, struct sockaddr *srcAddr, uint8_t *buf, uint16_t length);
+int sendPacketBatch(int socketNum, struct sockaddr *srcAddr, PacketDesc *packets[], int count);
 
 // for the server side
 int tcpServerSetup(int portNumber);
 int tcpAccept(int server_socket, int debugFlag);
-int udpServerSetup(int portNumber);
+int udpServerSetup(int portNumber, int *socketNums, int numSockets);
 
 // for the client side
 int tcpClientSetup(char * serverName, char * port, int debugFlag);
@@ -1,5 +1,6 @@
 // Base code provided by Hugh Smith; modified by Nick Spencer
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -16,29 +17,43 @@
 
 #include "cpe464.h"
 #include "networks.h"
+#include "diskWriter.h"
 
 #define MAXBUF 80
+
+/* Delivered data goes to the writer thread once a record is full, or once the oldest of it has waited this long */
+#define OUTPUT_FLUSH_USEC 100000
+
+/* In-order data is acknowledged once this many packets (at most a quarter of the window) are waiting for an RR,
+   or once the oldest of them has waited this long. A hole or the final packet is acknowledged right away */
+#define ACK_EVERY_PACKETS 16
+#define ACK_DELAY_USEC 200
 #define xstr(a) str(a)
 #define str(a) #a
 
 void processServer(int socketNum, struct sockaddr_in6 server);
 
-int waitOnData(int socketNum, struct sockaddr_in6 server, int *tries);
+int waitOnTimer(int socketNum, int64_t timeoutUsec);
+int waitOnData(int socketNum, struct sockaddr_in6 server);
 
 int sendSetupPacket(int socketNum, struct sockaddr_in6 server);
 
-int waitOnConnection(int socketNum, struct sockaddr_in6 server, int *tries);
-int waitOnFilenameResponse(int socketNum, struct sockaddr_in6 server, int *tries);
+int waitOnConnection(int socketNum, struct sockaddr_in6 server);
+int waitOnFilenameResponse(int socketNum, struct sockaddr_in6 server);
+
+int getData(int socketNum, RecvBatch *batch, struct sockaddr_in6 server);
+int processBatch(int socketNum, RecvBatch *batch, struct sockaddr_in6 server, int32_t *expectedSequence, ReceiveWindow *window, uint8_t *buf);
+int processData(uint8_t *buf, int32_t *expectedSequence, ReceiveWindow *window);
+int processExpectedPacket(uint8_t *buf, ReceiveWindow *window, Header header, int *expectedSequence);
+int processOverPacket(uint8_t *buf, ReceiveWindow *window, Header header, int *expectedSequence);
 
-int getData(int socketNum, uint8_t *buf, struct sockaddr_in6 server);
-int processData(int socketNum, uint8_t *buf, struct sockaddr_in6 server, int32_t *expectedSequence, int *srejSent, Packet *packets);
-int processExpectedPacket(int socketNum, struct sockaddr_in6 server, uint8_t *buf, Packet *packets, Header header, int windowSize, int *expectedSequence);
-int processOverPacket(int socketNum, struct sockaddr_in6 server, uint8_t *buf, Packet *packets, Header header, int windowSize, int *expectedSequence, int *srejSent);
-int processUnderPacket(int socketNum, struct sockaddr_in6 server, int *expectedSequence, int *srejSent, int windowSize, Packet *packets);
+int processSetupPacket(int socketNum, struct sockaddr_in6 *server, uint8_t *buf);
+int processFilenameResponse(int socketNum, struct sockaddr_in6 server, uint8_t *buf, ReceiveWindow *window);
+void processFileSize(uint8_t *buf, ReceiveWindow *window);
+int resendRR(int socketNum, struct sockaddr_in6 server, int *expectedSequence, ReceiveWindow *window, uint8_t *buf);
 
-int processSetupPacket(int socketNum, struct sockaddr_in6 *server, uint8_t *buf, int *tries);
-int processFilenameResponse(int socketNum, struct sockaddr_in6 server, uint8_t *buf, int *tries);
-int resendRR(int socketNum, struct sockaddr_in6 server, int *expectedSequence, uint8_t *buf);
+int getWindowBit(uint8_t *bits, uint32_t sequence);
+void setWindowBit(uint8_t *bits, uint32_t sequence, int value);
 
 int checkArgs(int argc, char * argv[]);
 
@@ -48,10 +63,19 @@ int windowSize;
 int bufferSize;
 float errorPercent;
 char remoteMachine[MAX_BUF];
+char congestion[CC_NAME_LEN];
 
 int outFile;
+DiskWriter *writer = NULL;
 int srej = 0;
 uint32_t sequenceNum = 0;
+int ackEvery;
+int unacked = 0;
+
+TimerWheel timers;
+Timer retransmitTimer;
+Timer idleTimer;
+Timer ackTimer;
 
 int main (int argc, char *argv[])
  {
@@ -67,12 +91,21 @@ int main (int argc, char *argv[])
       exit(-1);
    }
       
-   sendtoErr_init(errorPercent, DROP_ON, FLIP_ON, DEBUG_OFF, RSEED_ON);
+   initErrors(errorPercent);
    
     socketNum = setupUdpClientToServer(&server, remoteMachine, portNumber);
+   
+   /* Optional io_uring engine, anything still queued goes out before exiting */
+   initEngine();
+   watchSocket(socketNum);
+   atexit(flushPackets);
+   
+   /* UDP GRO is opt-in, with NETWORK_GRO=on */
+   enableGro(socketNum);
     
     processServer(socketNum, server);
     
+    flushPackets();
     close(socketNum);
 }
 
@@ -80,26 +113,52 @@ void processServer(int socketNum, struct sockaddr_in6 server)
 {
    int state = SEND_CONNECTION;
    uint8_t *buffer;
+   RecvBatch batch;
 
-   if ((buffer = malloc(MAX_BUF)) < 0)
+   if ((buffer = malloc(MAX_BUF)) == NULL)
    {
       perror("malloc");
       exit(-1);
    }
    
-   Packet *packets;
-   if ((packets = calloc(windowSize, sizeof(Packet))) < 0)
+   /* Data packets are received a batch at a time */
+   if ((batch.area = malloc(RECV_AREA)) == NULL)
+   {
+      perror("malloc");
+      exit(-1);
+   }
+   
+   /* Data goes to the file from a thread of its own, so a slow disk never holds up an RR */
+   writer = startDiskWriter(outFile);
+   
+   /* Out of order packets go straight to the file, the window only needs a bit per packet */
+   ReceiveWindow window;
+   window.finalSequence = -1;
+   window.highestReceived = -1;
+   if ((window.received = calloc((windowSize + 7) / 8, 1)) == NULL)
    {
       perror("calloc");
       exit(-1);
    }
    
    uint32_t expectedSequence = 0;
-   int srejSent = FALSE;
-   int tries = 10;   
    struct sockaddr_in6 parentServer;
    memcpy(&parentServer, &server, sizeof(struct sockaddr_in6));
    
+   /* Give up if the server stays quiet for too long */
+   initTimerWheel(&timers, getTimeUsec());
+   initTimer(&retransmitTimer, NULL, NULL);
+   initTimer(&idleTimer, NULL, NULL);
+   initTimer(&ackTimer, NULL, NULL);
+   startTimer(&timers, &idleTimer, getTimeUsec() + IDLE_TIMEOUT_USEC);
+   
+   /* A small window must not wait on the ack delay, the server could not send enough to trigger an RR */
+   ackEvery = windowSize / 4 < ACK_EVERY_PACKETS ? windowSize / 4 : ACK_EVERY_PACKETS;
+   if (ackEvery < 1)
+   {
+      ackEvery = 1;
+   }
+   
    while(state != DONE)
    {
       switch(state)
@@ -111,12 +170,12 @@ void processServer(int socketNum, struct sockaddr_in6 server)
          }
          case WAIT_ON_CONNECTION: /* Wait for packet to come */
          {
-            state = waitOnConnection(socketNum, server, &tries);
+            state = waitOnConnection(socketNum, server);
             break;
          }
          case GET_CONNECTION: /* Receive connection response packet */
          {
-            state = processSetupPacket(socketNum, &server, buffer, &tries);
+            state = processSetupPacket(socketNum, &server, buffer);
             break;
          }
          case SEND_FILENAME: /* Send filename packet */
@@ -127,32 +186,32 @@ void processServer(int socketNum, struct sockaddr_in6 server)
          }
          case WAIT_ON_FILENAME_RESPONSE: /* Wait on the filename response packet */
          {
-            state = waitOnFilenameResponse(socketNum, server, &tries);
+            state = waitOnFilenameResponse(socketNum, server);
             break;
          }
          case GET_FILENAME_RESPONSE: /* Receive filename response packet */
          {
-            state = processFilenameResponse(socketNum, server, buffer, &tries);
+            state = processFilenameResponse(socketNum, server, buffer, &window);
             break;
          }
          case WAIT_ON_DATA: /* Wait for more data packets to arrive */
          {
-            state = waitOnData(socketNum, server, &tries);
+            state = waitOnData(socketNum, server);
             break;
          }
-         case GET_DATA: /* Get an incoming data packet */
+         case GET_DATA: /* Get every data packet that has arrived */
          {
-            state = getData(socketNum, buffer, server);
+            state = getData(socketNum, &batch, server);
             break;
          }
-         case PROCESS_DATA: /* Process a received data packet */
+         case PROCESS_DATA: /* Process the received data packets, then acknowledge them */
          {
-            state = processData(socketNum, buffer, server, &expectedSequence, &srejSent, packets);
+            state = processBatch(socketNum, &batch, server, &expectedSequence, &window, buffer);
             break;
          }
-         case RESEND_RR: /* Resend the most recent RR */
+         case RESEND_RR: /* Resend the most recent RR, or SACK while there are holes */
          {
-            state = resendRR(socketNum, server, &expectedSequence, buffer);
+            state = resendRR(socketNum, server, &expectedSequence, &window, buffer);
             break;
          }
          default:
@@ -162,41 +221,105 @@ void processServer(int socketNum, struct sockaddr_in6 server)
          }
       }
    }
-   free(packets);
+   
+   /* Whatever arrived before the server went quiet still belongs in the file */
+   if (writer != NULL)
+   {
+      stopDiskWriter(writer);
+      writer = NULL;
+   }
+   free(window.received);
+   free(batch.area);
    free(buffer);
 }
 
-/* Resend the most recent RR */
-int resendRR(int socketNum, struct sockaddr_in6 server, int *expectedSequence, uint8_t *buf)
+/* Resend the most recent RR. While packets past a hole have arrived it goes out as a SACK instead, the RR
+   followed by a bitmap of which packets after it are in, so the server can resend every hole at once */
+int resendRR(int socketNum, struct sockaddr_in6 server, int *expectedSequence, ReceiveWindow *window, uint8_t *buf)
 {
    uint32_t seq = htonl(*expectedSequence);
+   uint8_t *bits = buf + sizeof(seq);
+   int count;
+   int i;
+   
+   /* This covers every packet waiting on a delayed RR */
+   unacked = 0;
+   stopTimer(&timers, &ackTimer);
    memcpy(buf, &seq, sizeof(*expectedSequence));
-   sendPacket(socketNum, sequenceNum, FLAG_5_RR, (struct sockaddr *) &server, (uint8_t *) buf, sizeof(*expectedSequence));
+   if (window->highestReceived <= *expectedSequence)
+   {
+      sendPacket(socketNum, sequenceNum, FLAG_5_RR, (struct sockaddr *) &server, (uint8_t *) buf, sizeof(*expectedSequence));
+      sequenceNum++;
+      return WAIT_ON_DATA;
+   }
+   
+   /* Bit i is the packet i + 1 past the RR, up to the highest one in (holes past the bitmap wait for the next) */
+   count = window->highestReceived - *expectedSequence < SACK_MAX_BYTES * 8 ? window->highestReceived - *expectedSequence : SACK_MAX_BYTES * 8;
+   memset(bits, 0, (count + 7) / 8);
+   for (i = 0; i < count; i++)
+   {
+      if (getWindowBit(window->received, *expectedSequence + 1 + i))
+      {
+         bits[i / 8] |= 1 << (i % 8);
+      }
+   }
+   sendPacket(socketNum, sequenceNum, FLAG_12_SACK, (struct sockaddr *) &server, (uint8_t *) buf, sizeof(*expectedSequence) + (count + 7) / 8);
    sequenceNum++;
    return WAIT_ON_DATA;
 }
 
-/* Wait for more data packets to arrive for 10 seconds */
-int waitOnData(int socketNum, struct sockaddr_in6 server, int *tries)
+/* Wait for a packet until the timeout (negative for none) runs out or the server has been quiet for too long */
+int waitOnTimer(int socketNum, int64_t timeoutUsec)
+{
+   int64_t now = getTimeUsec();
+   
+   if (timeoutUsec >= 0)
+   {
+      startTimer(&timers, &retransmitTimer, now + timeoutUsec);
+   }
+   while(1)
+   {
+      advanceTimers(&timers, now);
+      if (idleTimer.hasFired)
+      {
+         stopTimer(&timers, &retransmitTimer);
+         return TIMED_OUT;
+      }
+      if (retransmitTimer.hasFired || ackTimer.hasFired)
+      {
+         return DATA_NOT_READY;
+      }
+      
+      /* Sleep until the next timer, the server is still there if anything arrives */
+      if (safeSelect(socketNum, nextTimerUsec(&timers) - now) == DATA_READY)
+      {
+         stopTimer(&timers, &retransmitTimer);
+         startTimer(&timers, &idleTimer, getTimeUsec() + IDLE_TIMEOUT_USEC);
+         return DATA_READY;
+      }
+      now = getTimeUsec();
+   }
+}
+
+/* Wait for more data packets to arrive, the server resends anything unacknowledged */
+int waitOnData(int socketNum, struct sockaddr_in6 server)
 {
-   *tries = 1;
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, 10, tries); 
+   dataState = waitOnTimer(socketNum, -1); 
 
    switch(dataState)
    {
-      case DATA_NOT_READY: /* If no data ever comes in 10 seconds, end the process */
-      {
-         return DONE;
-      }
       case DATA_READY: /* Process the incoming data */
       {
          return GET_DATA;
       }
-      case TRIES_FINISHED: /* Not needed, but that is okay */
+      case DATA_NOT_READY: /* The delayed RR is due */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
-         exit(-1);
+         return RESEND_RR;
+      }
+      case TIMED_OUT: /* If no data ever comes, end the process */
+      {
+         return DONE;
       }
       default:
       {
@@ -206,103 +329,130 @@ int waitOnData(int socketNum, struct sockaddr_in6 server, int *tries)
    }
 }
 
-/* Get an incoming data packet */
-int getData(int socketNum, uint8_t *buf, struct sockaddr_in6 server)
+/* Get every data packet that has arrived, up to a batch */
+int getData(int socketNum, RecvBatch *batch, struct sockaddr_in6 server)
 {
-   /* Grab the data packet */
-   Header header;
-   int len = receivePacket(socketNum, buf, (struct sockaddr *) &server, sizeof(Header) + bufferSize);
-   memcpy(&header, buf, sizeof(Header));
-   
-   /* If the data packet is bad, wait for more */
-   if (len == 0)
+   /* If nothing was actually there, wait for more */
+   if (receivePacketBatch(socketNum, batch, (struct sockaddr *) &server, sizeof(Header) + bufferSize) < 0)
    {
       return WAIT_ON_DATA;
    }
    
    /* Otherwise, process the data */
-   else if (header.flag = FLAG_3_DATA)
+   return PROCESS_DATA;
+}
+
+/* Process a batch of received packets and acknowledge them with a single RR or SACK once the whole batch is handled,
+   buf is where an RR sent from here is built */
+int processBatch(int socketNum, RecvBatch *batch, struct sockaddr_in6 server, int32_t *expectedSequence, ReceiveWindow *window, uint8_t *buf)
+{
+   int32_t startSequence = *expectedSequence;
+   int sendRR = FALSE;
+   int state = WAIT_ON_DATA;
+   int i;
+   
+   /* Bad packets are skipped, as if they never arrived */
+   for (i = 0; i < batch->count && state != DONE; i++)
+   {
+      if (batch->lens[i] == 0)
+      {
+         continue;
+      }
+      if ((state = processData(batch->packets[i], expectedSequence, window)) == RESEND_RR)
+      {
+         sendRR = TRUE;
+      }
+   }
+   
+   /* A slow trickle of data still reaches the file before long */
+   if (writer != NULL)
    {
-      return PROCESS_DATA;
+      publishStaleWrites(writer, OUTPUT_FLUSH_USEC);
    }
    
-   /* If it is not a data packet, wait for more packets */
+   /* The final packet is acknowledged before finishing, a hole or a duplicate right away */
+   if (state == DONE)
+   {
+      resendRR(socketNum, server, expectedSequence, window, buf);
+      return DONE;
+   }
+   if (sendRR)
+   {
+      return RESEND_RR;
+   }
+   
+   /* In-order data waits for a few more packets to share its RR, but not for long */
+   if (*expectedSequence != startSequence)
+   {
+      unacked += *expectedSequence - startSequence;
+      if (unacked >= ackEvery)
+      {
+         return RESEND_RR;
+      }
+      if (!timerArmed(&ackTimer))
+      {
+         startTimer(&timers, &ackTimer, getTimeUsec() + ACK_DELAY_USEC);
+      }
+   }
    return WAIT_ON_DATA;
 }
 
 /* Process a received data packet */
-int processData(int socketNum, uint8_t *buf, struct sockaddr_in6 server, int32_t *expectedSequence, int *srejSent, Packet *packets)
+int processData(uint8_t *buf, int32_t *expectedSequence, ReceiveWindow *window)
 {
    Header header;
-   uint8_t *bufPtr = buf;
    
    /* Grab the header of the packet */
    memcpy(&header, buf, sizeof(Header));
    
+   /* Only data packets belong in the window (a repeated file size, for one, does not) */
+   if (header.flag != FLAG_3_DATA && header.flag != FLAG_10_FINAL_DATA)
+   {
+      return WAIT_ON_DATA;
+   }
+   
    /* If the packet is the expected packet, save it and write its contents to the file */
    if (header.sequence == *expectedSequence)
    {
-      //*srejSent = FALSE;
-      return processExpectedPacket(socketNum, server, buf, packets, header, windowSize, expectedSequence);
+      return processExpectedPacket(buf, window, header, expectedSequence);
    }
    
-   /* If the packet's sequence is greater than expected, send SREJ's for the missing packets */
+   /* If the packet's sequence is greater than expected, keep it and report the hole below it */
    else if (header.sequence > *expectedSequence)
    {
-      return processOverPacket(socketNum, server, buf, packets, header, windowSize, expectedSequence, srejSent);
+      return processOverPacket(buf, window, header, expectedSequence);
    }
    
-   /* If the packet's sequence is less than expected, send an SREJ if that was recently sent and/or an RR */
+   /* If the packet's sequence is less than expected, the server missed an RR (or SACK), send it again */
    else 
    {
-      return processUnderPacket(socketNum, server, expectedSequence, srejSent, windowSize, packets);
+      return RESEND_RR;
    }
 }
 
 /* Process a packet that was expected */
-int processExpectedPacket(int socketNum, struct sockaddr_in6 server, uint8_t *buf, Packet *packets, Header header, int windowSize, int *expectedSequence)
+int processExpectedPacket(uint8_t *buf, ReceiveWindow *window, Header header, int *expectedSequence)
 {
-   uint8_t *sendBuf;
-   if ((sendBuf = malloc(MAX_BUF)) < 0)
+   /* Queue this packet for the file */
+   queueWrite(writer, buf + sizeof(Header), header.length - sizeof(Header), (off_t) header.sequence * bufferSize);
+   if (header.flag == FLAG_10_FINAL_DATA)
    {
-      perror("malloc");
-      exit(-1);
+      window->finalSequence = header.sequence;
    }
    
-   /* Create and save this packet */
-   Packet packet;
-   memcpy(packet.buf, buf, header.length);
-   packet.sequence = header.sequence;
-   packet.header = header;
-   packet.isSREJ = FALSE;
-   memcpy(&(packets[header.sequence % windowSize]), &packet, sizeof(Packet));
-   
-   /* Write this packet and any other consecutive packets that already arrived with a higher sequence to the file */
-   while(packet.sequence == *expectedSequence)
+   /* Consecutive packets with a higher sequence that already arrived are queued too, move past them.
+      The RR for all of them goes out once the whole batch is processed */
+   do
    {
-      uint8_t *bufPtr = packet.buf;
-      memcpy(&header, bufPtr, sizeof(Header));
-      bufPtr += sizeof(Header);
-      
-      write(outFile, bufPtr, header.length - sizeof(Header));
-      
+      setWindowBit(window->received, *expectedSequence, FALSE);
       (*expectedSequence)++;
-      
-      uint32_t seq;
-      memcpy(&seq, expectedSequence, sizeof(uint32_t));
-      seq = htonl(seq);
-      memcpy(sendBuf, &seq, sizeof(uint32_t));
-      
-      sendPacket(socketNum, sequenceNum, FLAG_5_RR, (struct sockaddr *) &server, sendBuf, sizeof(*expectedSequence));  
-      sequenceNum++;
-      
-      memcpy(&packet, &(packets[(*expectedSequence) % windowSize]), sizeof(Packet));
-   }
-   free(sendBuf);
+   } while (getWindowBit(window->received, *expectedSequence));
    
-   /* If it is the last packet, make sure to close the file and exit */
-   if (header.flag == FLAG_10_FINAL_DATA)
+   /* If the last packet is in, make sure everything reaches the file, close it and exit */
+   if (window->finalSequence >= 0 && *expectedSequence > window->finalSequence)
    {
+      stopDiskWriter(writer);
+      writer = NULL;
       close(outFile);
       return DONE;
    }
@@ -311,68 +461,52 @@ int processExpectedPacket(int socketNum, struct sockaddr_in6 server, uint8_t *bu
 }
 
 /* Process a packet that has a higher sequence number than expected */
-int processOverPacket(int socketNum, struct sockaddr_in6 server, uint8_t *buf, Packet *packets, Header header, int windowSize, int *expectedSequence, int *srejSent)
+int processOverPacket(uint8_t *buf, ReceiveWindow *window, Header header, int *expectedSequence)
 {
-   uint8_t *sendBuf;
-   if ((sendBuf = malloc(MAX_BUF)) < 0)
+   /* The server never sends past the window, so there is no slot for anything further */
+   if (header.sequence >= (uint32_t) *expectedSequence + windowSize)
    {
-      perror("malloc");
-      exit(-1);
+      return WAIT_ON_DATA;
    }
    
-   /* If SREJ's have not yet been sent since the last expected packet arrived, send all the appropriate SREJ's */
-   uint32_t i;
-   Packet *prevPacket = &(packets[header.sequence % windowSize]);
-   for (i = *expectedSequence; i < header.sequence; i++)
+   /* Every packet but the last is bufferSize long, so this one can be queued for its place in the file right
+      away, only its bit remembers that it arrived */
+   if (!getWindowBit(window->received, header.sequence))
    {
-      Packet *packet = &(packets[i % windowSize]);
-      if ((packet->sequence != i) && ((packet->isSREJ == FALSE) ||  (prevPacket->isSREJ)))
+      queueWrite(writer, buf + sizeof(Header), header.length - sizeof(Header), (off_t) header.sequence * bufferSize);
+      setWindowBit(window->received, header.sequence, TRUE);
+      if (header.flag == FLAG_10_FINAL_DATA)
+      {
+         window->finalSequence = header.sequence;
+      }
+      if ((int64_t) header.sequence > window->highestReceived)
       {
-         uint32_t seq = htonl(i);
-         memcpy(sendBuf, &seq, sizeof(*expectedSequence));
-         sendPacket(socketNum, sequenceNum, FLAG_6_SREJ, (struct sockaddr *) &server, sendBuf, sizeof(*expectedSequence));
-         packet->isSREJ = TRUE;
-         sequenceNum++;
+         window->highestReceived = header.sequence;
       }
    }
    
-   /* Save the packet in the packet array */
-   Packet packet;
-   memcpy(packet.buf, buf, header.length);
-   packet.sequence = header.sequence;
-   packet.isSREJ = FALSE;
-   memcpy(&(packets[header.sequence % windowSize]), &packet, sizeof(Packet));
-   
-   free(sendBuf);
-   
-   /* Wait for more data to come */
-   return WAIT_ON_DATA;
+   /* The SACK for the hole below it goes out once the whole batch is processed */
+   return RESEND_RR;
 }
 
-/* Process a data packet that has a sequence number less than expected */
-int processUnderPacket(int socketNum, struct sockaddr_in6 server, int *expectedSequence, int *srejSent, int windowSize, Packet *packets)
+/* A sequence's bit in one of the window bitmaps, by its slot in the window */
+int getWindowBit(uint8_t *bits, uint32_t sequence)
 {
-   uint8_t *sendBuf;
-   if ((sendBuf = malloc(MAX_BUF)) < 0)
+   uint32_t slot = sequence % windowSize;
+   return (bits[slot / 8] >> (slot % 8)) & 1;
+}
+
+void setWindowBit(uint8_t *bits, uint32_t sequence, int value)
+{
+   uint32_t slot = sequence % windowSize;
+   if (value)
    {
-      perror("malloc");
-      exit(-1);
+      bits[slot / 8] |= 1 << (slot % 8);
    }
-   
-   Packet packet = packets[*expectedSequence % windowSize];
-   
-   /* If an SREJ(s) has been sent since the last expected packet, send it again */
-   if (packet.isSREJ)
-   {      
-      uint32_t seq = htonl(*expectedSequence);
-      memcpy(sendBuf, &seq, sizeof(*expectedSequence));
-      sendPacket(socketNum, sequenceNum, FLAG_6_SREJ, (struct sockaddr *) &server, sendBuf, sizeof(*expectedSequence));
-      sequenceNum++;
+   else
+   {
+      bits[slot / 8] &= ~(1 << (slot % 8));
    }
-   free(sendBuf);
-   
-   /* Just to try moving the window up, resend the most recent RR */
-   return RESEND_RR;
 }
 
 /* Send the first packet to the server */
@@ -385,6 +519,11 @@ int sendSetupPacket(int socketNum, struct sockaddr_in6 server)
    bufPtr += sizeof(windowSize);
    memcpy(bufPtr, &bufferSize, sizeof(bufferSize));
    bufPtr += sizeof(bufferSize);
+   if (congestion[0] != '\0')
+   {
+      memcpy(bufPtr, congestion, strlen(congestion) + 1);
+      bufPtr += strlen(congestion) + 1;
+   }
    
    uint16_t length = bufPtr - buf;
    sendPacket(socketNum, 0, FLAG_1_SETUP, (struct sockaddr *) &server, buf, length);
@@ -401,10 +540,10 @@ int sendSetupPacket(int socketNum, struct sockaddr_in6 server)
 }
 
 /* Wait for the connection response packet */
-int waitOnConnection(int socketNum, struct sockaddr_in6 server, int *tries)
+int waitOnConnection(int socketNum, struct sockaddr_in6 server)
 {   
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, 1, tries); 
+   dataState = waitOnTimer(socketNum, CONTROL_TIMEOUT_USEC); 
 
    switch(dataState)
    {
@@ -416,9 +555,9 @@ int waitOnConnection(int socketNum, struct sockaddr_in6 server, int *tries)
       {
          return GET_CONNECTION;
       }
-      case TRIES_FINISHED: /* If there is never a response from the server, end the connection */
+      case TIMED_OUT: /* If there is never a response from the server, end the connection */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
+         fprintf(stderr, "Timed out! Exiting... \n");
          exit(-1);
       }
       default:
@@ -430,10 +569,10 @@ int waitOnConnection(int socketNum, struct sockaddr_in6 server, int *tries)
 }
 
 /* Wait for a response about the filename */
-int waitOnFilenameResponse(int socketNum, struct sockaddr_in6 server, int *tries)
+int waitOnFilenameResponse(int socketNum, struct sockaddr_in6 server)
 {   
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, 1, tries); 
+   dataState = waitOnTimer(socketNum, CONTROL_TIMEOUT_USEC); 
 
    switch(dataState)
    {
@@ -445,9 +584,9 @@ int waitOnFilenameResponse(int socketNum, struct sockaddr_in6 server, int *tries
       {
          return GET_FILENAME_RESPONSE;
       }
-      case TRIES_FINISHED: /* If the response never comes, end connection */
+      case TIMED_OUT: /* If the response never comes, end connection */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
+         fprintf(stderr, "Timed out! Exiting... \n");
          exit(-1);
       }
       default:
@@ -459,14 +598,13 @@ int waitOnFilenameResponse(int socketNum, struct sockaddr_in6 server, int *tries
 }
 
 /* Process the incoming setup packet */
-int processSetupPacket(int socketNum, struct sockaddr_in6 *server, uint8_t *buf, int *tries)
+int processSetupPacket(int socketNum, struct sockaddr_in6 *server, uint8_t *buf)
 {
    int len = receivePacket(socketNum, buf, (struct sockaddr *) server, sizeof(Header));
    if (len == 0)
    {
       return SEND_CONNECTION;
    }
-   *tries = 10;
    Header header;
    uint8_t *bufPtr = buf;
    
@@ -483,51 +621,71 @@ int processSetupPacket(int socketNum, struct sockaddr_in6 *server, uint8_t *buf,
    return SEND_FILENAME;
 }
 
-/* Process the response to the filename */
-int processFilenameResponse(int socketNum, struct sockaddr_in6 server, uint8_t *buf, int *tries)
+/* Process the response to the filename, dispatching on the flag of the whole packet once its checksum is
+   good. It is peeked, so a data packet stays queued for the first batch */
+int processFilenameResponse(int socketNum, struct sockaddr_in6 server, uint8_t *buf, ReceiveWindow *window)
 {
    Header header;
-   *tries = 10;
-   int len = 0;
-   int addrLen = sizeof(struct sockaddr_in6);
-   if ((len = safeRecvfrom(socketNum, buf, sizeof(Header), MSG_PEEK, (struct sockaddr *) &server, &addrLen)) == 0)
+   int len = peekPacket(socketNum, buf, (struct sockaddr *) &server, MAX_BUF);
+   
+   /* A corrupted packet is thrown away, the server's next one is waited for */
+   if (len < 0)
    {
-      fprintf(stderr, "No message! Exiting... \n");
-      exit(-1);
+      return WAIT_ON_FILENAME_RESPONSE;
+   }
+   if (len == 0)
+   {
+      receivePacket(socketNum, buf, (struct sockaddr *) &server, MAX_BUF);
+      return WAIT_ON_FILENAME_RESPONSE;
    }
    memcpy(&header, buf, sizeof(Header));
+   
+   /* Data means the filename was good too (the file size was lost or there is none) */
+   if (header.flag == FLAG_3_DATA || header.flag == FLAG_10_FINAL_DATA)
+   {
+      return GET_DATA;
+   }
+   
+   /* Anything else is taken off the socket, the peek already has it in buf */
+   receivePacket(socketNum, buf, (struct sockaddr *) &server, MAX_BUF);
+   
+   /* If the filename is bad, print the errno message from the server */
    if (header.flag == FLAG_8_BAD_FILENAME)
    {
-      len = receivePacket(socketNum, buf, (struct sockaddr *) &server, MAX_BUF);
-      if (len == 0)
-      {
-         return SEND_FILENAME;
-      }
-      
-      /* If the filename is bad, print the errno message from the server */
-      else if (header.flag == FLAG_8_BAD_FILENAME)
-      {
-         uint8_t *bufPtr = buf + sizeof(Header);
-         memcpy(&errno, bufPtr, sizeof(errno));
-         sendHeader(socketNum, 0, FLAG_9_END_CONNECTION, (struct sockaddr *) &server, sizeof(struct sockaddr_in6));
-         perror("from server");      
-         exit(-1);
-      }
+      memcpy(&errno, buf + sizeof(Header), sizeof(errno));
+      sendHeader(socketNum, 0, FLAG_9_END_CONNECTION, (struct sockaddr *) &server, sizeof(struct sockaddr_in6));
+      perror("from server");
+      exit(-1);
    }
-   else if(header.flag == FLAG_3_DATA || header.flag == FLAG_10_FINAL_DATA)
+   
+   /* The file size means the filename was good and data follows */
+   else if (header.flag == FLAG_11_FILE_SIZE)
    {
-      len = receivePacket(socketNum, buf, (struct sockaddr *) &server, sizeof(Header) + bufferSize);
-      if (len == 0)
+      if (len == sizeof(Header) + sizeof(uint64_t))
       {
-         return SEND_FILENAME;
+         processFileSize(buf + sizeof(Header), window);
       }
-      return PROCESS_DATA;
+      return WAIT_ON_DATA;
    }
    
-   /* Otherwise, just resend the filename */
-   else
+   /* Otherwise, resend the filename */
+   return SEND_FILENAME;
+}
+
+/* Make room for the whole file up front and note which packet is the last one */
+void processFileSize(uint8_t *buf, ReceiveWindow *window)
+{
+   uint64_t size;
+   
+   memcpy(&size, buf, sizeof(size));
+   size = be64toh(size);
+   window->finalSequence = size == 0 ? 0 : (size - 1) / bufferSize;
+   
+   /* Reserve the blocks but keep the file size, so a transfer that fails part way leaves only what was written.
+      Not every filesystem can preallocate, the file then just grows as it is written */
+   if (size > 0)
    {
-      return SEND_FILENAME;
+      fallocate(outFile, FALLOC_FL_KEEP_SIZE, 0, size);
    }
 }
 
@@ -537,10 +695,10 @@ int checkArgs(int argc, char* argv[])
    int portNumber = 0;
    int error = 0;
    
-   /* There must be 8 args */
-   if (argc != 8)
+   /* There must be 8 args, 9 when picking a congestion controller */
+   if (argc != 8 && argc != 9)
    {
-     fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port]\n", argv[0]);
+     fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
      exit(-1);
    }
    
@@ -553,27 +711,27 @@ int checkArgs(int argc, char* argv[])
    /* Grab windowsize */
    if ((windowSize = atoi(argv[3])) == 0)
    {
-        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port]\n", argv[0]);
+        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
         exit(-1);
    }
    
    /* Then grab buffersize */
    if ((bufferSize = atoi(argv[4])) == 0)
    {
-        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port]\n", argv[0]);
+        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
         exit(-1);
    }
    if (bufferSize > 1400)
    {
-      fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port]\n", argv[0]);
+      fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
         exit(-1);
    }
    
    /* Then grab errorpercent */
    errorPercent = atof(argv[5]);
-   if (errorPercent <= 0 || errorPercent >= 1)
+   if (errorPercent < 0 || errorPercent >= 1)
    {
-        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port]\n", argv[0]);
+        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
         exit(-1);
    }
    
@@ -583,9 +741,20 @@ int checkArgs(int argc, char* argv[])
    /* Finally, the port number */
    if ((portNumber = atoi(argv[7])) == 0)
    {
-        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port]\n", argv[0]);
+        fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
         exit(-1);
    }
+   
+   /* The server falls back to its default controller unless one is named */
+   if (argc == 9)
+   {
+      if (strlen(argv[8]) >= CC_NAME_LEN || findCongestion(argv[8]) == NULL)
+      {
+         fprintf(stderr, "Usage %s: [local-file] [remote-file] [window-size] [buffer-size] [error-percent] [remote-machine] [remote-port] [optional congestion-control: aimd|cubic|bbr]\n", argv[0]);
+         exit(-1);
+      }
+      memcpy(congestion, argv[8], strlen(argv[8]) + 1);
+   }
 
     return portNumber;
 }
\ No newline at end of file
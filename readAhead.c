@@ -0,0 +1,403 @@
+// Read-ahead that keeps file I/O off the server's event loop
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "networks.h"
+#include "readAhead.h"
+
+/* The populate pool, shared by every session with a mapped file. A session is queued (or held by a pool
+   thread) while isQueued is set */
+static pthread_once_t populateOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t populateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t populateCond = PTHREAD_COND_INITIALIZER;
+static ReadAhead *populateHead = NULL;
+static ReadAhead *populateTail = NULL;
+static int populateThreads = 0;
+static int populateLoops = 1;
+
+/* Cancellation can land in the condition wait, which returns holding the lock */
+static void unlockReadAhead(void *arg)
+{
+   pthread_mutex_unlock(arg);
+}
+
+/* Reader thread: fill the chunks in turn, each as soon as the session hands it back, until the file ends */
+static void *readChunks(void *arg)
+{
+   ReadAhead *ra = arg;
+   int chunk = 0;
+   int err = 0;
+   ssize_t len;
+   ssize_t n;
+
+   do
+   {
+      pthread_mutex_lock(&(ra->lock));
+      pthread_cleanup_push(unlockReadAhead, &(ra->lock));
+      while (ra->isFull[chunk] && !ra->isStopped)
+      {
+         pthread_cond_wait(&(ra->cond), &(ra->lock));
+      }
+      pthread_cleanup_pop(1);
+      if (ra->isStopped)
+      {
+         break;
+      }
+
+      /* Pipes hand data over in small pieces, keep reading until the chunk is full or the file ends */
+      for (len = 0; len < ra->chunkSize; len += n)
+      {
+         if ((n = read(ra->file, ra->chunks[chunk] + len, ra->chunkSize - len)) < 0 && errno == EINTR)
+         {
+            n = 0;
+         }
+         else if (n <= 0)
+         {
+            err = n < 0 ? errno : 0;
+            break;
+         }
+      }
+
+      pthread_mutex_lock(&(ra->lock));
+      ra->lens[chunk] = len;
+      ra->err = err;
+      ra->isFull[chunk] = TRUE;
+      pthread_mutex_unlock(&(ra->lock));
+      chunk = (chunk + 1) % READ_AHEAD_CHUNKS;
+   } while (len == ra->chunkSize);
+
+   return NULL;
+}
+
+/* Fault in one chunk of the mapping, FALSE when the kernel cannot do that for us */
+static int populateChunk(uint8_t *start, size_t len)
+{
+#ifdef MADV_POPULATE_READ
+   return madvise(start, len, MADV_POPULATE_READ) == 0;
+#else
+   return FALSE;
+#endif
+}
+
+/* Caller holds populateLock: put a session at the back of the pool's queue */
+static void queuePopulate(ReadAhead *ra)
+{
+   ra->nextQueued = NULL;
+   if (populateTail == NULL)
+   {
+      populateHead = ra;
+   }
+   else
+   {
+      populateTail->nextQueued = ra;
+   }
+   populateTail = ra;
+   pthread_cond_signal(&populateCond);
+}
+
+/* Caller holds populateLock: take a session off the pool's queue, FALSE if a pool thread already has it */
+static int unqueuePopulate(ReadAhead *ra)
+{
+   ReadAhead *prev = NULL;
+   ReadAhead *cur = populateHead;
+
+   while (cur != NULL && cur != ra)
+   {
+      prev = cur;
+      cur = cur->nextQueued;
+   }
+   if (cur == NULL)
+   {
+      return FALSE;
+   }
+   if (prev == NULL)
+   {
+      populateHead = ra->nextQueued;
+   }
+   else
+   {
+      prev->nextQueued = ra->nextQueued;
+   }
+   if (populateTail == ra)
+   {
+      populateTail = prev;
+   }
+   return TRUE;
+}
+
+/* Pool thread: fault in one chunk for the session at the front of the queue, then put it at the back if it is
+   still within a couple of chunks of its send cursor, so every session gets a turn */
+static void *populateChunks(void *arg)
+{
+   long pageSize = sysconf(_SC_PAGESIZE);
+   ReadAhead *ra;
+   off_t start;
+   off_t len;
+   int isPopulated;
+
+   while (TRUE)
+   {
+      pthread_mutex_lock(&populateLock);
+      while (populateHead == NULL)
+      {
+         pthread_cond_wait(&populateCond, &populateLock);
+      }
+      ra = populateHead;
+      if ((populateHead = ra->nextQueued) == NULL)
+      {
+         populateTail = NULL;
+      }
+      pthread_mutex_unlock(&populateLock);
+
+      /* Only the pool thread holding the session moves resident, and the mapping starts on a page so every
+         chunk does too */
+      start = ra->resident;
+      len = ra->mapLen - start < ra->chunkSize ? ra->mapLen - start : ra->chunkSize;
+      isPopulated = populateChunk(ra->map + start, (len + pageSize - 1) / pageSize * pageSize);
+
+      /* Without the kernel's help the session sends straight from the mapping, as if there were no read-ahead */
+      pthread_mutex_lock(&populateLock);
+      pthread_mutex_lock(&(ra->lock));
+      ra->resident = isPopulated ? start + len : ra->mapLen;
+      if (!ra->isStopped && ra->resident < ra->mapLen
+         && ra->resident - ra->wanted < (off_t) READ_AHEAD_CHUNKS * ra->chunkSize)
+      {
+         queuePopulate(ra);
+      }
+      else
+      {
+         ra->isQueued = FALSE;
+         pthread_cond_signal(&(ra->cond));
+      }
+      pthread_mutex_unlock(&(ra->lock));
+      pthread_mutex_unlock(&populateLock);
+   }
+   return arg;
+}
+
+/* Start the pool threads the first time a mapped file needs them, in whichever process maps it */
+static void startPopulatePool()
+{
+   pthread_t thread;
+   int i;
+
+   for (i = 0; i < POPULATE_THREADS_PER_LOOP * populateLoops; i++)
+   {
+      if (pthread_create(&thread, NULL, populateChunks, NULL) == 0)
+      {
+         pthread_detach(thread);
+         populateThreads++;
+      }
+   }
+}
+
+/* TRUE if a bounded sample of pages spread over the mapping is all in memory, so the event loop pays the same
+   few mincore() calls for any size of file. A file that is mostly cached but has a cold page between the
+   samples just faults it in when that page is sent */
+static int isInPageCache(uint8_t *map, off_t mapLen)
+{
+   long pageSize = sysconf(_SC_PAGESIZE);
+   off_t pages = (mapLen + pageSize - 1) / pageSize;
+   unsigned char isResident;
+   off_t page;
+   int i;
+
+   for (i = 0; i < RESIDENT_SAMPLES; i++)
+   {
+      page = pages * i / RESIDENT_SAMPLES;
+      if (mincore(map + page * pageSize, pageSize, &isResident) != 0 || (isResident & 1) == 0)
+      {
+         return FALSE;
+      }
+   }
+
+   /* The last page too, the samples stop short of it */
+   return mincore(map + (pages - 1) * pageSize, pageSize, &isResident) == 0 && (isResident & 1) != 0;
+}
+
+/* Start reading the file ahead in chunks of whole slices, NULL if the buffers or thread cannot be had */
+ReadAhead *startReadAhead(int file, int sliceSize)
+{
+   ReadAhead *ra;
+   long pageSize = sysconf(_SC_PAGESIZE);
+   int i;
+
+   if ((ra = calloc(1, sizeof(ReadAhead))) == NULL)
+   {
+      return NULL;
+   }
+   ra->file = file;
+   ra->chunkSize = READ_AHEAD_CHUNK - READ_AHEAD_CHUNK % sliceSize;
+   for (i = 0; i < READ_AHEAD_CHUNKS; i++)
+   {
+      if (posix_memalign((void **) &(ra->chunks[i]), pageSize, ra->chunkSize) != 0)
+      {
+         ra->chunks[i] = NULL;
+         break;
+      }
+   }
+   pthread_mutex_init(&(ra->lock), NULL);
+   pthread_cond_init(&(ra->cond), NULL);
+
+   if (i < READ_AHEAD_CHUNKS || pthread_create(&(ra->thread), NULL, readChunks, ra) != 0)
+   {
+      for (i = 0; i < READ_AHEAD_CHUNKS; i++)
+      {
+         free(ra->chunks[i]);
+      }
+      pthread_mutex_destroy(&(ra->lock));
+      pthread_cond_destroy(&(ra->cond));
+      free(ra);
+      return NULL;
+   }
+   return ra;
+}
+
+/* Copy the next slice of the file into buf without blocking, like read(): the bytes copied, 0 at the end
+   of the file, or -1 with errno EAGAIN while the reader has not filled the next chunk yet */
+ssize_t readAhead(ReadAhead *ra, uint8_t *buf, int length)
+{
+   ssize_t len;
+
+   pthread_mutex_lock(&(ra->lock));
+
+   /* A full chunk that has been sliced up goes back to the reader (a short one is the end of the file) */
+   if (ra->isFull[ra->current] && ra->offset == ra->lens[ra->current] && ra->lens[ra->current] == ra->chunkSize)
+   {
+      ra->isFull[ra->current] = FALSE;
+      ra->current = (ra->current + 1) % READ_AHEAD_CHUNKS;
+      ra->offset = 0;
+      pthread_cond_signal(&(ra->cond));
+   }
+   if (!ra->isFull[ra->current])
+   {
+      pthread_mutex_unlock(&(ra->lock));
+      errno = EAGAIN;
+      return -1;
+   }
+
+   len = ra->lens[ra->current] - ra->offset < length ? ra->lens[ra->current] - ra->offset : length;
+   if (len == 0 && ra->err != 0)
+   {
+      errno = ra->err;
+      pthread_mutex_unlock(&(ra->lock));
+      return -1;
+   }
+   pthread_mutex_unlock(&(ra->lock));
+
+   /* The reader leaves a full chunk alone until it is handed back, so the copy needs no lock */
+   memcpy(buf, ra->chunks[ra->current] + ra->offset, len);
+   ra->offset += len;
+   return len;
+}
+
+/* Size the populate pool for the number of event loops in this process, before the first file is mapped */
+void sizePopulatePool(int eventLoops)
+{
+   populateLoops = eventLoops;
+}
+
+/* Start faulting in a mapped file ahead of the session on the shared pool, NULL if there is no point (the file
+   is under a chunk or already in the page cache) or no pool thread can be had */
+ReadAhead *startMapAhead(uint8_t *map, off_t mapLen)
+{
+   ReadAhead *ra;
+
+   if (mapLen <= READ_AHEAD_CHUNK || isInPageCache(map, mapLen))
+   {
+      return NULL;
+   }
+   pthread_once(&populateOnce, startPopulatePool);
+   if (populateThreads == 0 || (ra = calloc(1, sizeof(ReadAhead))) == NULL)
+   {
+      return NULL;
+   }
+   ra->file = -1;
+   ra->chunkSize = READ_AHEAD_CHUNK;
+   ra->map = map;
+   ra->mapLen = mapLen;
+   ra->isQueued = TRUE;
+   pthread_mutex_init(&(ra->lock), NULL);
+   pthread_cond_init(&(ra->cond), NULL);
+
+   pthread_mutex_lock(&populateLock);
+   queuePopulate(ra);
+   pthread_mutex_unlock(&populateLock);
+   return ra;
+}
+
+/* Without blocking, TRUE if the mapping is in memory up to end (the session wants to send that far), otherwise
+   FALSE. The session goes back on the pool's queue once it gets within a couple of chunks of what is resident */
+int mapAhead(ReadAhead *ra, off_t end)
+{
+   int isResident;
+   int isBehind;
+
+   pthread_mutex_lock(&(ra->lock));
+   if (end > ra->wanted)
+   {
+      ra->wanted = end;
+   }
+   isResident = end <= ra->resident;
+   isBehind = !ra->isQueued && ra->resident < ra->mapLen
+      && ra->resident - ra->wanted < (off_t) READ_AHEAD_CHUNKS * ra->chunkSize;
+   if (isBehind)
+   {
+      ra->isQueued = TRUE;
+   }
+   pthread_mutex_unlock(&(ra->lock));
+
+   if (isBehind)
+   {
+      pthread_mutex_lock(&populateLock);
+      queuePopulate(ra);
+      pthread_mutex_unlock(&populateLock);
+   }
+   return isResident;
+}
+
+/* Stop the reader, even one blocked on a pipe that never ends, or wait out a pool thread populating the
+   mapping, and free everything */
+void stopReadAhead(ReadAhead *ra)
+{
+   int i;
+
+   if (ra->map != NULL)
+   {
+      pthread_mutex_lock(&populateLock);
+      pthread_mutex_lock(&(ra->lock));
+      ra->isStopped = TRUE;
+      if (ra->isQueued && unqueuePopulate(ra))
+      {
+         ra->isQueued = FALSE;
+      }
+      pthread_mutex_unlock(&populateLock);
+      while (ra->isQueued)
+      {
+         pthread_cond_wait(&(ra->cond), &(ra->lock));
+      }
+      pthread_mutex_unlock(&(ra->lock));
+   }
+   else
+   {
+      pthread_mutex_lock(&(ra->lock));
+      ra->isStopped = TRUE;
+      pthread_cond_signal(&(ra->cond));
+      pthread_mutex_unlock(&(ra->lock));
+      pthread_cancel(ra->thread);
+      pthread_join(ra->thread, NULL);
+   }
+
+   for (i = 0; i < READ_AHEAD_CHUNKS; i++)
+   {
+      free(ra->chunks[i]);
+   }
+   pthread_mutex_destroy(&(ra->lock));
+   pthread_cond_destroy(&(ra->cond));
+   free(ra);
+}
@@ -0,0 +1,60 @@
+// Read-ahead that keeps file I/O off the server's event loop
+//
+// For files the server cannot map, a reader thread fills two large chunks from
+// the file in turn while the session slices packets out of the other one, so a
+// pipe or slow filesystem is read in big blocking reads instead of one small
+// read per packet. Chunks are a whole number of packets long, so a slice never
+// spans two chunks and only the final slice of the file comes back short.
+//
+// For mapped files a small pool of threads shared by every session faults the
+// mapping in a couple of chunks ahead of each send cursor instead, so a cold
+// page is waited for there and not inside sendmsg(), and the session only sends
+// what is already in memory. A session waiting for its chunks goes on the back
+// of the pool's queue after each one, so one large cold file cannot hold the
+// pool. Files under a chunk, or whose sampled pages are all in the page cache
+// already, skip the pool. The pool has POPULATE_THREADS_PER_LOOP threads for
+// each event loop in the process: one can sit on a cold chunk of a slow disk
+// while the other keeps the rest of that loop's sessions moving, and more would
+// only queue deeper on the same disk.
+
+#ifndef __READ_AHEAD_H__
+#define __READ_AHEAD_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define READ_AHEAD_CHUNK (1 << 20)
+#define READ_AHEAD_CHUNKS 2
+#define POPULATE_THREADS_PER_LOOP 2
+#define RESIDENT_SAMPLES 64
+
+typedef struct readAhead {
+   int file;
+   int chunkSize;
+   uint8_t *chunks[READ_AHEAD_CHUNKS];
+   ssize_t lens[READ_AHEAD_CHUNKS];
+   int isFull[READ_AHEAD_CHUNKS];
+   int current;
+   ssize_t offset;
+   int err;
+   uint8_t *map;
+   off_t mapLen;
+   off_t resident;
+   off_t wanted;
+   int isQueued;
+   struct readAhead *nextQueued;
+   int isStopped;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+} ReadAhead;
+
+ReadAhead *startReadAhead(int file, int sliceSize);
+ssize_t readAhead(ReadAhead *ra, uint8_t *buf, int length);
+void sizePopulatePool(int eventLoops);
+ReadAhead *startMapAhead(uint8_t *map, off_t mapLen);
+int mapAhead(ReadAhead *ra, off_t end);
+void stopReadAhead(ReadAhead *ra);
+
+#endif
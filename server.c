@@ -1,427 +1,1510 @@
 // Base code provided by Hugh Smith; modified by Nick Spencer
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
 
 #include "cpe464.h"
 #include "networks.h"
+#include "sessionTable.h"
 
 #define MAXBUF 80
+#define MAX_EVENTS 64
+#define SESSION_BURST 64
+#define DELIVERY_RUNS 4
 
 
-void listenForClients(int socketNum);
+void startThreads(int portNumber);
+void startProcesses(int portNumber);
+pid_t forkWorker(int socketNum, int *workerSockets, int slot);
+void restartWorker(int socketNum, int *workerSockets, pid_t *workerPids, int slot);
+void dispatchClients(int socketNum, int *workerSockets, pid_t *workerPids);
+void *startWorker(void *arg);
+void listenForClients(Worker *worker);
+void receivePackets(Worker *worker);
+void receiveHandoffs(Worker *worker);
+void deliverPacket(Worker *worker, struct sockaddr_in6 *remote, uint8_t *buf, int32_t len);
+void acceptClient(Worker *worker, struct sockaddr_in6 *remote, uint8_t *buf, int32_t len);
+void checkEngine(Worker *worker);
+int runSession(Session *session);
+void removeSession(Worker *worker, Session *session);
+void closeSession(Session *session);
+int nextTimeout(Worker *worker);
+void markRunnable(Session *session);
+void clearRunnable(Session *session);
+void wakeSession(Timer *timer);
+int waitOnSession(Session *session, int64_t timeoutUsec);
+int receiveSessionPacket(Session *session, uint8_t *buf, int length);
 
-void processClient(int serverSocketNum, uint8_t *buf, int32_t len, Connection client);
-int processSetupPacket(uint8_t *buf, int32_t len, Connection *client, int *windowSize, int *bufferSize, Packet **packets);
+int processSetupPacket(Session *session, int32_t len);
 
-int prepareData(int socketNum, struct sockaddr_in6 server, Packet *packets, uint32_t *currentPreparePacket, int32_t file, int bufferSize, int windowSize, int *currentRR, int *donePreparing);
-int sendData(int socketNum, Connection *client, Packet *packets, uint32_t *currentPacket, int *currentRR, int *currentSREJ, int windowSize, uint32_t *currentPreparePacket, int *donePreparing);
-int processAck(int socketNum, struct sockaddr_in6 server, int *currentRR, int *currentSREJ, int *donePreparing, int *tries);
-int checkForAck(int socketNum, struct sockaddr_in6 server, int *tries, int seconds);
-int waitForAck(int socketNum, struct sockaddr_in6 server, int *tries, int seconds, int *currentRR, int *currentPacket, Packet *packets, int windowSize);
+int prepareData(Session *session);
+int prepareOnePacket(Session *session);
+int sendData(Session *session);
+int processAck(Session *session);
+int processRR(Session *session, uint32_t seq, int64_t now);
+void queueHoles(Session *session, uint32_t seq, uint8_t *bits, int bytes, int64_t now);
+int resendBatch(Session *session, PacketDesc *batch[], int count, int64_t now);
+void queueResend(Session *session, uint32_t seq);
+void dropResends(Session *session, uint32_t end);
+int sendResends(Session *session);
+int fileShrank();
+int checkForAck(Session *session);
+int waitForAck(Session *session);
+void updateRto(Session *session, int64_t sample);
+int64_t paceDelay(Session *session, int size);
+int waitToSend(Session *session);
+int waitForFile(Session *session);
 
-int waitOnFilename(int socketNum, struct sockaddr_in6 server, int *tries);
-int processFilename(int socketNum, uint8_t *buf, int *datafile, Connection *client, int *isErr, int *tries);
+int waitOnFilename(Session *session);
+int processFilename(Session *session);
+void mapFile(Session *session);
+void sendFileSize(Session *session);
 
-int sendFilenameResponse(int socketNum, Connection *client, int *isErr);
-int waitOnFilenameResponse(int socketNum, Connection *client, int *tries);
-int processFilenameResponse(uint8_t *buf, Connection *client);
+int sendFilenameResponse(Session *session);
+int waitOnFilenameResponse(Session *session);
+int processFilenameResponse(Session *session);
 
 int checkArgs(int argc, char *argv[]);
 
-int lastPacket = -1;
 float errorPercent = 0.0f;
+int numWorkers = 1;
+int isPrefork = FALSE;
+int64_t rateCap = 0;
 
 int main (int argc, char *argv[])
 { 
-	int socketNum = 0;				
-	struct sockaddr_in6 client;	// Can be either IPv4 or 6
 	int portNumber = 0;
-   pthread_t thread[MAX_THREADS];
    
 	portNumber = checkArgs(argc, argv);
-	socketNum = udpServerSetup(portNumber);
+   
+   /* A file that shrinks while it is sent from its mapping ends that session, not the server */
+   guardPacketData();
+   
+   if (isPrefork)
+   {
+      startProcesses(portNumber);
+   }
+   else
+   {
+      startThreads(portNumber);
+   }
+}
 
-   listenForClients(socketNum);
+/* Run each worker as a thread with its own SO_REUSEPORT socket */
+void startThreads(int portNumber)
+{
+   int socketNums[MAX_THREADS];
+   Worker workers[MAX_THREADS];
+   int i;
+   
+	udpServerSetup(portNumber, socketNums, numWorkers);
+   initErrors(errorPercent);
+   
+   /* Mapped files of every worker are faulted in by one pool sized for all of them, a pre-forked worker
+      keeps the default of one event loop */
+   sizePopulatePool(numWorkers);
+   
+   /* Every worker gets its own socket, epoll set and session table, so they share nothing */
+   memset(workers, 0, sizeof(workers));
+   for (i = 0; i < numWorkers; i++)
+   {
+      workers[i].id = i;
+      workers[i].socketNum = socketNums[i];
+      if (pthread_create(&(workers[i].thread), NULL, startWorker, &(workers[i])) != 0)
+      {
+         fprintf(stderr, "pthread_create failed\n");
+         exit(-1);
+      }
+   }
+   
+   for (i = 0; i < numWorkers; i++)
+   {
+      pthread_join(workers[i].thread, NULL);
+   }
 }
 
-void listenForClients(int socketNum)
-{  
-   pid_t pid = 0;
+/* Fork the pool of worker processes up front, the parent hands them every datagram */
+void startProcesses(int portNumber)
+{
+   int socketNum;
+   int workerSockets[MAX_THREADS];
+   pid_t workerPids[MAX_THREADS];
+   int i;
+   
+	udpServerSetup(portNumber, &socketNum, 1);
+   initErrors(errorPercent);
+   
+   /* A worker that exits should not take the listening process with it */
+   signal(SIGPIPE, SIG_IGN);
+   
+   for (i = 0; i < numWorkers; i++)
+   {
+      workerSockets[i] = -1;
+   }
+   for (i = 0; i < numWorkers; i++)
+   {
+      workerPids[i] = forkWorker(socketNum, workerSockets, i);
+   }
+   
+   dispatchClients(socketNum, workerSockets, workerPids);
+}
+
+/* Fork the worker for one slot of the pool, connected to the parent by a new socketpair, returns its pid */
+pid_t forkWorker(int socketNum, int *workerSockets, int slot)
+{
+   int pair[2];
+   pid_t pid;
+   int i;
+   
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0)
+   {
+      perror("socketpair");
+      exit(-1);
+   }
+   
+   /* Whatever the parent has buffered would be printed again by the child */
+   fflush(stdout);
+   if ((pid = fork()) < 0)
+   {
+      perror("fork");
+      exit(-1);
+   }
+   
+   /* Child Process: run the event loop on the handoff socket until the parent goes away,
+      replies still go out on the well-known socket so clients only ever see one port */
+   if (pid == 0)
+   {
+      Worker worker;
+      memset(&worker, 0, sizeof(worker));
+      close(pair[0]);
+      for (i = 0; i < numWorkers; i++)
+      {
+         if (workerSockets[i] >= 0)
+         {
+            close(workerSockets[i]);
+         }
+      }
+      worker.socketNum = socketNum;
+      worker.handoffSocket = pair[1];
+      worker.isHandoff = TRUE;
+      listenForClients(&worker);
+      exit(0);
+   }
+   
+   /* Parent Process */
+   close(pair[1]);
+   workerSockets[slot] = pair[0];
+   return pid;
+}
+
+/* A worker exited (every fatal error exits its process), fork a new one into its slot. The sessions it held
+   are gone and their clients time out, but the clients that hash to the slot are served again */
+void restartWorker(int socketNum, int *workerSockets, pid_t *workerPids, int slot)
+{
+   fprintf(stderr, "Worker %d exited, starting a new one\n", slot);
+   close(workerSockets[slot]);
+   workerSockets[slot] = -1;
+   workerPids[slot] = forkWorker(socketNum, workerSockets, slot);
+}
+
+/* Listening process loop: send each datagram to the worker its client address hashes to.
+   Every datagram of every client goes through this one process and a copy over the socketpair, so
+   the pool spreads the session work but not the receive path, which stays within what one core can
+   receive and hand off. The threads model, where the kernel spreads clients over SO_REUSEPORT
+   sockets, has no such funnel */
+void dispatchClients(int socketNum, int *workerSockets, pid_t *workerPids)
+{
+   Handoff handoff;
    int status = 0;
-   fd_set sockets;
-   uint8_t buf[MAX_BUF];
-   int32_t len;
-   Connection client;
+   pid_t pid;
+   int i;
+   
+   while(1)
+   {
+      handoff.len = receivePacket(socketNum, handoff.buf, (struct sockaddr *) &(handoff.remote), MAX_BUF);
+      if (handoff.len <= 0)
+      {
+         continue;
+      }
+      
+      /* Replace any worker that exited before routing to its slot again */
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+      {
+         for (i = 0; i < numWorkers; i++)
+         {
+            if (workerPids[i] == pid)
+            {
+               restartWorker(socketNum, workerSockets, workerPids, i);
+            }
+         }
+      }
+      
+      /* The same client always lands on the same worker, which holds its session. The handoff
+         is local, so it skips the error injection hooks (the packet already went through them) */
+      int worker = hashAddress(&(handoff.remote)) % numWorkers;
+      if ((send)(workerSockets[worker], &handoff, sizeof(Handoff) - MAX_BUF + handoff.len, 0) < 0)
+      {
+         /* The worker is on its way out, the datagram is lost like any other and its replacement gets the next one */
+         if ((errno == EPIPE || errno == ECONNRESET) && waitpid(workerPids[worker], &status, 0) == workerPids[worker])
+         {
+            restartWorker(socketNum, workerSockets, workerPids, worker);
+         }
+         else
+         {
+            perror("send to worker");
+         }
+      }
+   }
+}
+
+/* Pin the worker thread to a core and run its event loop */
+void *startWorker(void *arg)
+{
+   Worker *worker = arg;
+   cpu_set_t cpus;
+   
+   CPU_ZERO(&cpus);
+   CPU_SET(worker->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+   pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+   
+   listenForClients(worker);
+   return NULL;
+}
+
+/* Event loop for one worker: every client is a session driven from the worker's epoll set */
+void listenForClients(Worker *worker)
+{  
+   int i;
+   int numEvents;
+   struct epoll_event event;
+   struct epoll_event events[MAX_EVENTS];
+   
+   if ((worker->epollFd = epoll_create1(0)) < 0)
+   {
+      perror("epoll_create1");
+      exit(-1);
+   }
+   
+   /* Every client talks to the one listening socket. A pre-forked worker shares it with the
+      listening process (which blocks on it), so it only sends there and hears from the handoff socket */
+   event.events = EPOLLIN;
+   event.data.ptr = NULL;
+   if (!worker->isHandoff)
+   {
+      setNonBlocking(worker->socketNum);
+   }
+   if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->isHandoff ? worker->handoffSocket : worker->socketNum, &event) < 0)
+   {
+      perror("epoll_ctl");
+      exit(-1);
+   }
+   
+   /* Session timers live on the worker's wheel, the timerfd wakes the loop for the next one */
+   initTimerWheel(&(worker->timers), getTimeUsec());
+   worker->timerArmedAt = -1;
+   if ((worker->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+   {
+      perror("timerfd_create");
+      exit(-1);
+   }
+   event.events = EPOLLIN;
+   event.data.ptr = &(worker->timers);
+   if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->timerFd, &event) < 0)
+   {
+      perror("epoll_ctl");
+      exit(-1);
+   }
+   
+   /* With the io_uring engine packets show up as completions on the ring instead */
+   initEngine();
+   if (engineFd() >= 0)
+   {
+      if (!worker->isHandoff)
+      {
+         watchSocket(worker->socketNum);
+      }
+      event.events = EPOLLIN;
+      event.data.ptr = worker;
+      if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, engineFd(), &event) < 0)
+      {
+         perror("epoll_ctl");
+         exit(-1);
+      }
+   }
    
-   /* Loop forever looking for new clients */
+   /* Loop forever looking for new clients and running the existing ones */
    while(1)
    {
-      /* Reset all the sockets */
-      FD_ZERO(&sockets);
-      FD_SET(socketNum, &sockets);
-            
-      /* Wait for packets to arrive */
-      if (select(socketNum + 1, &sockets, NULL, NULL, NULL) < 0)
+      /* Everything the sessions queued goes to the kernel in one go, packets the engine already
+         reaped (possibly while sending) reach their sessions before the loop decides to sleep */
+      flushPackets();
+      if (engineFd() >= 0)
+      {
+         checkEngine(worker);
+      }
+      
+      if ((numEvents = epoll_wait(worker->epollFd, events, MAX_EVENTS, nextTimeout(worker))) < 0)
       {
-         perror("select");
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("epoll_wait");
          exit(-1);
       }
       
-      /* A new client wants to connect! */
-      if (FD_ISSET(socketNum, &sockets))
-      {         
-         len = receivePacket(socketNum, buf, (struct sockaddr *) &(client.remote), sizeof(Header) + 2 * sizeof(int));
-         if (len > 0)
+      for (i = 0; i < numEvents; i++)
+      {
+         /* Datagrams arrived from new or existing clients */
+         if (events[i].data.ptr == NULL)
          {
-            if ((pid = fork()) < 0)
+            if (worker->isHandoff)
             {
-               perror("fork");
-               exit(-1);
+               receiveHandoffs(worker);
             }
-            
-            /* Child Process */
-            if (pid == 0)
+            else
             {
-               sendtoErr_init(errorPercent, DROP_ON, FLIP_ON, DEBUG_OFF, RSEED_ON);
-               processClient(socketNum, buf, len, client);
+               receivePackets(worker);
             }
          }
-         
-         /* Parent Process */
-         while(waitpid(-1, &status, WNOHANG) > 0);
+         else if (events[i].data.ptr == &(worker->timers)) /* A timer is due */
+         {
+            uint64_t expirations;
+            read(worker->timerFd, &expirations, sizeof(expirations));
+         }
+         else /* Completions on the io_uring engine */
+         {
+            checkEngine(worker);
+         }
       }
-      else
+      
+      /* Fire every timer that is due, each wakes up its session */
+      advanceTimers(&(worker->timers), getTimeUsec());
+      
+      /* Run every session that has data, has not used up its burst or whose timer expired, once each. A session
+         still runnable afterwards is queued again behind the last one and waits for the next pass */
+      Session *last = worker->runnable.tail;
+      int isLast = FALSE;
+      while (!isLast && worker->runnable.head != NULL)
+      {
+         Session *session = worker->runnable.head;
+         isLast = session == last;
+         if (runSession(session) == DONE)
+         {
+            removeSession(worker, session);
+         }
+      }
+   }
+}
+
+/* Read every datagram queued on the worker's socket and route each one to its session */
+void receivePackets(Worker *worker)
+{
+   uint8_t buf[MAX_BUF];
+   struct sockaddr_in6 remote;
+   int32_t len;
+   
+   while ((len = receivePacket(worker->socketNum, buf, (struct sockaddr *) &remote, MAX_BUF)) >= 0)
+   {
+      /* Bad checksums are dropped here, the session will time out and resend */
+      if (len > 0)
       {
-         fprintf(stderr, "Invalid Socket\n");
+         deliverPacket(worker, &remote, buf, len);
       }
    }
 }
 
-/* State machine for each individual thread (so each individual client) */
-void processClient(int serverSocketNum, uint8_t *buf, int32_t len, Connection client)
+/* Pre-forked workers get every datagram and its client address from the listening process */
+void receiveHandoffs(Worker *worker)
 {
-   int file;
-   int state = PROCESS_SETUP;
-   int tries = 1;
-   int checkTries = 1;
-   int isErr = 0;
-   int windowSize = 0;
-   int bufferSize = 0;
-   int currentRR = 0;
-   int currentSREJ = -1;
-   uint32_t currentPacket = 0;
-   uint32_t currentPreparePacket = 0;
-   int donePreparing = FALSE;
-   Packet *packets = NULL;
+   Handoff handoff;
+   int len;
    
-   while(state != DONE)
+   while ((len = (recv)(worker->handoffSocket, &handoff, sizeof(Handoff), MSG_DONTWAIT)) > 0)
+   {
+      deliverPacket(worker, &(handoff.remote), handoff.buf, handoff.len);
+   }
+   
+   /* The listening process went away, so this worker is done too */
+   if (len == 0)
+   {
+      exit(0);
+   }
+}
+
+/* Hand a datagram to the session of the client that sent it, starting one for a new client */
+void deliverPacket(Worker *worker, struct sockaddr_in6 *remote, uint8_t *buf, int32_t len)
+{
+   Session *session = findSession(&(worker->table), remote);
+   Header header;
+   int runs;
+   
+   memcpy(&header, buf, sizeof(Header));
+   if (header.flag == FLAG_1_SETUP)
+   {
+      /* A new client wants to connect! */
+      if (session == NULL)
+      {
+         acceptClient(worker, remote, buf, len);
+      }
+      else if (session->state == WAIT_ON_FILENAME) /* The client never got the setup response, send it again */
+      {
+         sendHeader(worker->socketNum, 0, FLAG_2_SETUP, (struct sockaddr *) remote, sizeof(struct sockaddr_in6));
+      }
+      return;
+   }
+   
+   /* Nothing to do with a packet from a client without a session */
+   if (session == NULL)
+   {
+      return;
+   }
+   
+   /* The client is still there */
+   startTimer(session->timers, &(session->idleTimer), getTimeUsec() + IDLE_TIMEOUT_USEC);
+   
+   /* The session reads the datagram from its inbox, run it now so the inbox is free for the next one */
+   memcpy(session->inbox, buf, len);
+   session->inboxLen = len;
+   session->isReadable = TRUE;
+   for (runs = 0; session->inboxLen > 0 && runs < DELIVERY_RUNS; runs++)
+   {
+      if (runSession(session) == DONE)
+      {
+         removeSession(worker, session);
+         return;
+      }
+   }
+   
+   /* The session never got to it, drop the datagram like a full socket buffer would */
+   session->inboxLen = 0;
+   session->isReadable = FALSE;
+}
+
+/* Start a session for the client that sent a setup packet */
+void acceptClient(Worker *worker, struct sockaddr_in6 *remote, uint8_t *buf, int32_t len)
+{
+   Session *session;
+   
+   if ((session = calloc(1, sizeof(Session))) == NULL)
+   {
+      perror("calloc");
+      exit(-1);
+   }
+   
+   memcpy(&(session->remote), remote, sizeof(struct sockaddr_in6));
+   memcpy(session->buf, buf, len);
+   session->socketNum = worker->socketNum;
+   session->file = -1;
+   session->rto = RTO_INITIAL_USEC;
+   session->rateCap = rateCap;
+   session->lastPacket = -1;
+   session->fileSize = -1;
+   session->donePreparing = FALSE;
+   session->state = processSetupPacket(session, len);
+   if (session->state == DONE)
+   {
+      closeSession(session);
+      return;
+   }
+   session->runQueue = &(worker->runnable);
+   markRunnable(session);
+   
+   /* The session ends if the client goes quiet for too long */
+   session->timers = &(worker->timers);
+   initTimer(&(session->timer), wakeSession, session);
+   initTimer(&(session->idleTimer), wakeSession, session);
+   startTimer(session->timers, &(session->idleTimer), getTimeUsec() + IDLE_TIMEOUT_USEC);
+   
+   /* Grow the session list if needed */
+   if (worker->numSessions == worker->maxSessions)
+   {
+      worker->maxSessions = worker->maxSessions ? 2 * worker->maxSessions : 16;
+      if ((worker->sessions = realloc(worker->sessions, worker->maxSessions * sizeof(Session *))) == NULL)
+      {
+         perror("realloc");
+         exit(-1);
+      }
+   }
+   session->index = worker->numSessions;
+   worker->sessions[worker->numSessions++] = session;
+   insertSession(&(worker->table), session);
+}
+
+/* Reap the io_uring engine and route every packet it received */
+void checkEngine(Worker *worker)
+{
+   flushPackets();
+   if (!worker->isHandoff)
+   {
+      receivePackets(worker);
+   }
+}
+
+/* Arm the timerfd for the wheel's next expiry, returns the epoll timeout (0 when a session can run now) */
+int nextTimeout(Worker *worker)
+{
+   int64_t next;
+   struct itimerspec spec;
+   
+   if (worker->runnable.head != NULL)
+   {
+      return 0;
+   }
+   
+   /* Only touch the timerfd when the next expiry moved (a zero it_value disarms it) */
+   if ((next = nextTimerUsec(&(worker->timers))) != worker->timerArmedAt)
+   {
+      memset(&spec, 0, sizeof(spec));
+      if (next >= 0)
+      {
+         spec.it_value.tv_sec = next / 1000000;
+         spec.it_value.tv_nsec = (next % 1000000) * 1000;
+      }
+      if (timerfd_settime(worker->timerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+      {
+         perror("timerfd_settime");
+         exit(-1);
+      }
+      worker->timerArmedAt = next;
+   }
+   return -1;
+}
+
+/* Queue the session to run on the next pass of the event loop, if it is not queued already */
+void markRunnable(Session *session)
+{
+   RunQueue *queue = session->runQueue;
+   
+   if (session->isRunnable)
+   {
+      return;
+   }
+   session->isRunnable = TRUE;
+   session->prevRunnable = queue->tail;
+   session->nextRunnable = NULL;
+   if (queue->tail != NULL)
+   {
+      queue->tail->nextRunnable = session;
+   }
+   else
+   {
+      queue->head = session;
+   }
+   queue->tail = session;
+}
+
+/* Take the session off the run queue, wherever it is */
+void clearRunnable(Session *session)
+{
+   RunQueue *queue = session->runQueue;
+   
+   if (!session->isRunnable)
+   {
+      return;
+   }
+   session->isRunnable = FALSE;
+   if (session->prevRunnable != NULL)
+   {
+      session->prevRunnable->nextRunnable = session->nextRunnable;
+   }
+   else
+   {
+      queue->head = session->nextRunnable;
+   }
+   if (session->nextRunnable != NULL)
+   {
+      session->nextRunnable->prevRunnable = session->prevRunnable;
+   }
+   else
+   {
+      queue->tail = session->prevRunnable;
+   }
+   session->prevRunnable = NULL;
+   session->nextRunnable = NULL;
+}
+
+/* Timer callback: the session has something to do (a wait ran out or the client went quiet) */
+void wakeSession(Timer *timer)
+{
+   markRunnable(timer->owner);
+}
+
+/* Wait (without blocking) up to the given microseconds for data to be delivered to the session */
+int waitOnSession(Session *session, int64_t timeoutUsec)
+{
+   /* Data arrived, so the wait is over */
+   if (session->isReadable)
+   {
+      stopTimer(session->timers, &(session->timer));
+      session->isWaiting = FALSE;
+      return DATA_READY;
+   }
+   
+   /* Start a new wait */
+   if (!session->isWaiting)
+   {
+      session->isWaiting = TRUE;
+      startTimer(session->timers, &(session->timer), getTimeUsec() + timeoutUsec);
+      return DATA_BLOCKED;
+   }
+   
+   /* The wait timed out */
+   if (session->timer.hasFired)
+   {
+      session->timer.hasFired = FALSE;
+      session->isWaiting = FALSE;
+      return DATA_NOT_READY;
+   }
+   
+   return DATA_BLOCKED;
+}
+
+/* Take the datagram waiting in the session's inbox, -1 if there is none */
+int receiveSessionPacket(Session *session, uint8_t *buf, int length)
+{
+   int len = session->inboxLen;
+   
+   session->inboxLen = 0;
+   session->isReadable = FALSE;
+   if (len == 0)
+   {
+      return -1;
+   }
+   if (len > length)
+   {
+      len = length;
+   }
+   memcpy(buf, session->inbox, len);
+   return len;
+}
+
+/* State machine for each individual client, run until it has to wait or uses up its burst */
+int runSession(Session *session)
+{
+   int steps;
+   int state = session->state;
+   
+   clearRunnable(session);
+   
+   /* Nothing has been heard from the client for too long */
+   if (session->idleTimer.hasFired)
+   {
+      fprintf(stderr, "Client timed out! Ending session... \n");
+      state = DONE;
+   }
+   
+   for (steps = 0; steps < SESSION_BURST && state != DONE; steps++)
    {
       switch(state)
       {
-         case PROCESS_SETUP: /* Process the first packet received from parent process */
-         {
-            state = processSetupPacket(buf, len, &client, &windowSize, &bufferSize, &packets);
-            break;
-         }
          case SEND_SETUP_RESPONSE: /* Respond to client with a successful connection message */
          {
-            sendHeader(client.socketNum, 0, FLAG_2_SETUP, (struct sockaddr *) &(client.remote), sizeof(struct sockaddr_in6));
+            sendHeader(session->socketNum, 0, FLAG_2_SETUP, (struct sockaddr *) &(session->remote), sizeof(struct sockaddr_in6));
             state = WAIT_ON_FILENAME;
             break;
          }
          case WAIT_ON_FILENAME: /* Wait for the filename packet from the client */
          {
-            state = waitOnFilename(client.socketNum, client.remote, &tries);
+            state = waitOnFilename(session);
             break;
          }
          case GET_FILENAME: /* Get and process the filename packet that arrived */
          {
-            state = processFilename(client.socketNum, buf, &file, &client, &isErr, &tries);
+            state = processFilename(session);
             break;
          }
          case SEND_FILENAME_RESPONSE: /* Send the errno response to the client for a bad filename */
          {
-            state = sendFilenameResponse(client.socketNum, &client, &isErr);
+            state = sendFilenameResponse(session);
             break;
          }
          case WAIT_ON_FILENAME_RESPONSE: /* Wait for the client to disconnect, resend filename if this times out */
          {
-            state = waitOnFilenameResponse(client.socketNum, &client, &tries);
+            state = waitOnFilenameResponse(session);
             break;
          }
          case GET_FILENAME_RESPONSE: /* Get the response from the client about the filename (presumably to end connection) */
          {
-            state = processFilenameResponse(buf, &client);
+            state = processFilenameResponse(session);
             break;
          }
          case PREPARE_DATA: /* Prepare a data packet within the window and save it within packets array */
          {
-            state = prepareData(client.socketNum, client.remote, packets, &currentPreparePacket, file, bufferSize, windowSize, &currentRR, &donePreparing);
+            state = prepareData(session);
             break;
          }
-         case SEND_DATA: /* Send either the next data packet or a repeat packet from a received SREJ */
+         case SEND_DATA: /* Send the packets queued to go out again, otherwise the next data packets */
          {
-            state = sendData(client.socketNum, &client, packets, &currentPacket, &currentRR, &currentSREJ, windowSize, &currentPreparePacket, &donePreparing);
+            state = sendData(session);
             break;
          }
-         case WAIT_FOR_ACK: /* Wait 1 second for an RR or SREJ packet, otherwise resend lowest packet in window (10 tries) */
+         case WAIT_FOR_ACK: /* Wait one RTO for an RR or SREJ packet, otherwise resend lowest packet in window */
          {
-            state = waitForAck(client.socketNum, client.remote, &tries, 1, &currentRR, &currentPacket, packets, windowSize);
+            state = waitForAck(session);
             break;
          }
-         case CHECK_FOR_ACK: /* Wait 0 seconds for an RR or SREJ packet, otherwise goto SEND_DATA state */
+         case CHECK_FOR_ACK: /* Look for an RR or SREJ packet without waiting, otherwise goto SEND_DATA state */
          {
-            state = checkForAck(client.socketNum, client.remote, &checkTries, 0);
+            state = checkForAck(session);
             break;
          }
          case PROCESS_ACK: /* Process and incoming RR or SREJ packet */
          {
-            state = processAck(client.socketNum, client.remote, &currentRR, &currentSREJ, &donePreparing, &tries);
+            state = processAck(session);
             break;
          }
-         default: /* State machine should never reach the default state, so exit */
+         case WAIT_TO_SEND: /* Wait for the pacing bucket to allow the next packet, or an RR or SREJ packet */
          {
-            fprintf(stderr, "Bad state: %d, Exiting...\n", state);
-            exit(-1);
+            state = waitToSend(session);
+            break;
          }
+         case WAIT_FOR_FILE: /* Wait for the read-ahead to bring in the next chunk, or an RR or SREJ packet */
+         {
+            state = waitForFile(session);
+            break;
+         }
+         default: /* State machine should never reach the default state, so end the session */
+         {
+            fprintf(stderr, "Bad state: %d, Ending session...\n", state);
+            state = DONE;
+         }
+      }
+      
+      /* Go back to the event loop until data arrives, the timer expires or the socket drains */
+      if (session->isWaiting || session->isRunnable)
+      {
+         break;
+      }
+   }
+   
+   /* Burst used up, let the other sessions run before continuing */
+   if (steps == SESSION_BURST)
+   {
+      markRunnable(session);
+   }
+   session->state = state;
+   return state;
+}
+
+/* Take a finished session out of the worker's table and list, then release it */
+void removeSession(Worker *worker, Session *session)
+{
+   clearRunnable(session);
+   deleteSession(&(worker->table), session);
+   worker->sessions[session->index] = worker->sessions[--(worker->numSessions)];
+   worker->sessions[session->index]->index = session->index;
+   closeSession(session);
+}
+
+/* Release everything a finished session holds (the socket belongs to the worker) */
+void closeSession(Session *session)
+{
+   /* Per-session stats, the RTT estimate is what drove the retransmissions */
+   if (session->packetsSent > 0)
+   {
+      printf("Session stats: %u packets sent, %u resent, %u acks received, %u RTT samples, SRTT %lld us, RTTVAR %lld us, RTO %lld us, %s cwnd %d, pacing %.1f Mb/s\n",
+         session->packetsSent, session->packetsResent, session->acksReceived, session->rttSamples, (long long) session->srtt, (long long) session->rttvar, (long long) session->rto,
+         session->cc.ops->name, congestionWindow(&(session->cc)), session->pacingRate * 8 / 1000000.0);
+      fflush(stdout);
+   }
+   stopTimer(session->timers, &(session->timer));
+   stopTimer(session->timers, &(session->idleTimer));
+   if (session->readAhead != NULL)
+   {
+      stopReadAhead(session->readAhead);
+   }
+   if (session->map != NULL)
+   {
+      munmap(session->map, session->mapLen);
+   }
+   if (session->file >= 0)
+   {
+      close(session->file);
+   }
+   if (session->packets != NULL)
+   {
+      free(session->packets);
+   }
+   if (session->resends != NULL)
+   {
+      free(session->resends);
+   }
+   if (session->payloads != NULL)
+   {
+      free(session->payloads);
+   }
+   free(session);
+}
+
+/* Prepare data packets within the window, enough for the next batch to send, and save them within packets array */
+int prepareData(Session *session)
+{
+   int batch = congestionWindow(&(session->cc)) - (session->currentPacket - session->currentRR);
+   int result;
+   
+   if (batch > SEND_BATCH)
+   {
+      batch = SEND_BATCH;
+   }
+   
+   /* Stop once all of the data from the file has been copied or the entire window has been prepared */
+   while (!session->donePreparing && session->currentPreparePacket - session->currentRR < session->windowSize)
+   {
+      if ((int) (session->currentPreparePacket - session->currentPacket) >= batch)
+      {
+         break;
+      }
+      if ((result = prepareOnePacket(session)) == DONE)
+      {
+         return DONE;
+      }
+      
+      /* The file is not read that far yet: send what is ready, only wait when there is nothing to send */
+      if (result == WAIT_FOR_FILE)
+      {
+         if (session->resendCount == 0 && session->currentPacket >= session->currentPreparePacket)
+         {
+            return WAIT_FOR_FILE;
+         }
+         break;
+      }
+   }
+   
+   return SEND_DATA;
+}
+
+/* Fill the window slot after the last packet prepared with the next buffer of the file: a view into the mapping
+   once the read-ahead has it in memory when the file is mapped, otherwise sliced out of the read-ahead (or read, if that could not start) into the
+   slot's place in the payload arena */
+int prepareOnePacket(Session *session)
+{
+   PacketDesc *packet = &(session->packets[session->currentPreparePacket % session->windowSize]);
+   uint8_t *payload;
+   int length = 0;
+   
+   if (session->map != NULL)
+   {
+      length = session->mapLen - session->mapOffset < session->bufferSize ? session->mapLen - session->mapOffset : session->bufferSize;
+      if (session->readAhead != NULL && !mapAhead(session->readAhead, session->mapOffset + length))
+      {
+         return WAIT_FOR_FILE;
+      }
+      packet->data = session->map + session->mapOffset;
+      session->mapOffset += length;
+   }
+   else if (session->fileSize == 0)
+   {
+      /* An empty file is just the final packet, there is nothing to read (any valid pointer does for no data) */
+      packet->data = session->buf;
+   }
+   else
+   {
+      payload = session->payloads + (size_t) (session->currentPreparePacket % session->windowSize) * session->bufferSize;
+      
+      /* Read the next buffer length of the data */
+      if (session->readAhead != NULL)
+      {
+         length = readAhead(session->readAhead, payload, session->bufferSize);
+      }
+      else
+      {
+         length = read(session->file, payload, session->bufferSize);
+      }
+      if (length < 0)
+      {
+         if (session->readAhead != NULL && errno == EAGAIN)
+         {
+            return WAIT_FOR_FILE;
+         }
+         perror("read");
+         return DONE;
+      }
+      packet->data = payload;
+   }
+   
+   /* Prepare the packet to store */
+   packet->sequence = session->currentPreparePacket;
+   packet->sentAt = 0;
+   packet->retransmits = 0;
+   packet->length = length;
+   
+   /* A full packet short of the end of a file of known size, or of anything else, is a normal packet (so a
+      file that is a whole number of packets long ends on a full one) */
+   if (length == session->bufferSize && (session->fileSize < 0 || packet->sequence != session->lastPacket))
+   {
+      packet->flag = FLAG_3_DATA;
+   }
+   else /* Otherwise, it is the last data packet */
+   {
+      packet->flag = FLAG_10_FINAL_DATA;
+      session->donePreparing = TRUE;
+      session->lastPacket = session->currentPreparePacket;
+   }
+   
+   /* Increment the next packet to prepare */
+   session->currentPreparePacket++;
+   
+   return SEND_DATA;
+}
+
+/* Send the packets queued to go out again, otherwise the next data packets */
+int sendData(Session *session)
+{
+   PacketDesc *packet;
+   
+   /* If the packet about to be sent is less than the current RR, update currentPacket */
+   if (session->currentPacket < session->currentRR)
+   {
+      session->currentPacket = session->currentRR;
+   }
+   
+   /* Lost packets go out again before anything new, they are already inside the window */
+   if (session->resendCount > 0)
+   {
+      return sendResends(session);
+   }
+   
+   /* If the window is closed, as far as the congestion controller lets it open */
+   else if (session->currentPacket - session->currentRR >= congestionWindow(&(session->cc)))
+   {
+      return WAIT_FOR_ACK;
+   }
+   
+   /* If the packet to be sent has not been prepared yet, prepare it, or wait for ACK if the last packet has been stored */
+   else if (session->currentPacket >= session->currentPreparePacket)
+   {
+      if (session->donePreparing || (session->currentPreparePacket - session->currentRR >= session->windowSize))
+      {
+         return WAIT_FOR_ACK;
+      }
+      return PREPARE_DATA;
+   }
+   else /* Send the prepared packets from currentPacket on, as many as the window and the pacing bucket allow, in one batch */
+   {
+      PacketDesc *batch[SEND_BATCH];
+      int count = congestionWindow(&(session->cc)) - (session->currentPacket - session->currentRR);
+      int sent;
+      int i;
+      int64_t now;
+      
+      packet = &(session->packets[session->currentPacket % session->windowSize]);
+      
+      /* New packets go out no faster than the pacing rate, retransmissions above do not wait */
+      if (paceDelay(session, packet->length) > 0)
+      {
+         return WAIT_TO_SEND;
+      }
+      if (session->pacingRate > 0 && count > session->tokens / session->bufferSize)
+      {
+         count = session->tokens / session->bufferSize > 1 ? session->tokens / session->bufferSize : 1;
+      }
+      if (count > session->currentPreparePacket - session->currentPacket)
+      {
+         count = session->currentPreparePacket - session->currentPacket;
+      }
+      if (count > SEND_BATCH)
+      {
+         count = SEND_BATCH;
+      }
+      for (i = 0; i < count; i++)
+      {
+         batch[i] = &(session->packets[(session->currentPacket + i) % session->windowSize]);
+      }
+      
+      /* Socket buffer is full, try the same packets again on the next run */
+      if ((sent = sendPacketBatch(session->socketNum, (struct sockaddr *) &(session->remote), batch, count)) == 0)
+      {
+         markRunnable(session);
+         return SEND_DATA;
+      }
+      if (sent < 0)
+      {
+         return fileShrank();
+      }
+      now = getTimeUsec();
+      for (i = 0; i < sent; i++)
+      {
+         /* Packets sent again after a timeout are retransmissions, Karn's rule must not sample them */
+         if (batch[i]->sentAt != 0)
+         {
+            batch[i]->retransmits++;
+            session->packetsResent++;
+         }
+         else
+         {
+            session->packetsSent++;
+         }
+         batch[i]->sentAt = now;
+         session->tokens -= batch[i]->length;
+      }
+      session->currentPacket += sent;
+      packet = batch[sent - 1];
+   }
+   
+   /* If it is the last packet, wait 1 sec for ACK */
+   if (packet->flag == FLAG_10_FINAL_DATA)
+   {
+      return WAIT_FOR_ACK;
+   }
+   
+   /* otherwise, check for ACK */
+   return CHECK_FOR_ACK;
+}
+
+/* Process and incoming RR, SACK or SREJ packet */
+int processAck(Session *session)
+{
+   uint8_t buf[MAX_BUF];
+   uint8_t *bufPtr = buf;
+   uint32_t seq;
+   int64_t now;
+   
+   /* Receive the packet */
+   int len = receiveSessionPacket(session, bufPtr, MAX_BUF);
+   if (len < 0) /* The ACK has already been read */
+   {
+      return PREPARE_DATA;
+   }
+   
+   /* Grab contents from the packet */
+   Header header;
+   memcpy(&header, bufPtr, sizeof(Header));
+   bufPtr += sizeof(Header);
+   memcpy(&seq, bufPtr, sizeof(seq));  
+   seq = ntohl(seq);
+   now = getTimeUsec();
+   
+   /* Feedback of any kind counts toward the session's ack rate */
+   if (header.flag == FLAG_5_RR || header.flag == FLAG_12_SACK || header.flag == FLAG_6_SREJ)
+   {
+      session->acksReceived++;
+   }
+   
+   /* If the packet is RR, make sure to update the current packet, if it is the last one, end the session */
+   if (header.flag == FLAG_5_RR)
+   {
+      return processRR(session, seq, now);
+   }
+   
+   /* A SACK is an RR with the holes above it, every one known to be lost is resent right away */
+   else if (header.flag == FLAG_12_SACK)
+   {
+      if (processRR(session, seq, now) == DONE)
+      {
+         return DONE;
       }
+      queueHoles(session, seq, bufPtr + sizeof(seq), len - (int) (sizeof(Header) + sizeof(seq)), now);
+      return CHECK_FOR_ACK;
+   }
+   
+   /* If the packet is SREJ, queue that packet so it is sent again right away */
+   else if (header.flag == FLAG_6_SREJ)
+   {
+      congestionLoss(&(session->cc), seq, session->currentPacket, FALSE, now);
+      queueResend(session, seq);
+      return SEND_DATA;
+   }
+   
+   /* The client is still asking for the file, so the file size never made it */
+   else if (header.flag == FLAG_7_FILENAME)
+   {
+      sendFileSize(session);
+      return PREPARE_DATA;
    }
-   if (packets != NULL)
+   else /* Otherwise, the packet should be ignored */
    {
-      free(packets);
+      return PREPARE_DATA;
    }
-   exit(0);
 }
 
-/* Prepare a data packet within the window and save it within packets array */
-int prepareData(int socketNum, struct sockaddr_in6 server, Packet *packets, uint32_t *currentPreparePacket, int32_t file, int bufferSize, int windowSize, int *currentRR, int *donePreparing)
+/* Move the window up to an RR, if it covers the last packet, end the session */
+int processRR(Session *session, uint32_t seq, int64_t now)
 {
-   Packet packet;
-   int length = 0;
-   uint8_t data[MAX_BUF];
-   Header header;
-   
-   /* If all of the data from the file has been copied, just send data */
-   if (*donePreparing)
+   /* Karn's rule: only the newest packet the RR covers, and only if it went out once, gives an RTT sample */
+   if ((int) seq > session->currentRR && (int) seq <= session->currentPacket)
    {
-      return SEND_DATA;
+      PacketDesc *acked = &(session->packets[(seq - 1) % session->windowSize]);
+      if (acked->retransmits == 0)
+      {
+         updateRto(session, now - acked->sentAt);
+         congestionRtt(&(session->cc), now - acked->sentAt, now);
+      }
    }
-   
-   /* If the entire window has already been prepared, just send data */
-   if ((*currentPreparePacket) - (*currentRR) >= windowSize)
+   if ((int) seq > session->currentRR)
    {
-      return SEND_DATA;
+      congestionAck(&(session->cc), seq - session->currentRR, now);
    }
    
-   /* Read the next buffer length of the data */
-   if((length = read(file, data, bufferSize)) < 0)
+   if (session->donePreparing && (int) seq > session->lastPacket)
    {
-      perror("read");
-      exit(-1);
+      return DONE;
+   }
+   if ((int) seq > session->currentRR)
+   {
+      dropResends(session, seq);
    }
+   session->currentRR = seq;
+   return CHECK_FOR_ACK;
+}
+
+/* Queue the holes a SACK reports to go out again, the RR itself and every clear bit below the highest set one.
+   A hole is only lost once something sent after it has arrived, so a hole whose retransmission is still on the
+   way is left alone */
+void queueHoles(Session *session, uint32_t seq, uint8_t *bits, int bytes, int64_t now)
+{
+   PacketDesc *packet;
+   PacketDesc *newest = NULL;
+   uint32_t sequence;
+   int isLoss = FALSE;
+   int last;
+   int i;
    
-   /*Prepare the packet to store */
-   memcpy(&(packet.buf), data, length);
-   packet.sequence = *currentPreparePacket;
-   header.length = length;
+   /* The rest of the last byte after the highest packet received is only padding */
+   for (last = bytes * 8 - 1; last >= 0 && !((bits[last / 8] >> (last % 8)) & 1); last--)
+   {
+   }
    
-   /* If the length is the size of the bufferSize, there is still more data, so it is a normal packet */
-   if (length == bufferSize) 
+   /* Bit i is the packet i + 1 past the RR. Packets go out in sequence order within a batch, so the one sent
+      last of those that arrived is the newest sent, then the highest */
+   for (i = 0; i <= last; i++)
    {
-      header.flag = FLAG_3_DATA;
+      sequence = seq + 1 + i;
+      packet = &(session->packets[sequence % session->windowSize]);
+      if (((bits[i / 8] >> (i % 8)) & 1) && (int) sequence >= session->currentRR && (int) sequence < session->currentPacket &&
+         (newest == NULL || packet->sentAt >= newest->sentAt))
+      {
+         newest = packet;
+      }
    }
-   else /* Otherwise, it is the last data packet */
+   if (newest == NULL)
    {
-      header.flag = FLAG_10_FINAL_DATA;
-      *donePreparing = TRUE;
-      lastPacket = *currentPreparePacket;
+      return;
    }
    
-   /* Store the packet */
-   packet.header = header;
-   memcpy(&(packets[(*currentPreparePacket) % windowSize]), &packet, sizeof(Packet));
-   packet = packets[(*currentPreparePacket) % windowSize];
-   
-   /* Increment the next packet to prepare */
-   (*currentPreparePacket)++;
-   
-   return SEND_DATA;
+   /* The RR itself is the first hole */
+   for (i = -1; i < last; i++)
+   {
+      sequence = seq + 1 + i;
+      if ((i >= 0 && ((bits[i / 8] >> (i % 8)) & 1)) || (int) sequence < session->currentRR || (int) sequence >= session->currentPacket)
+      {
+         continue;
+      }
+      packet = &(session->packets[sequence % session->windowSize]);
+      if (packet->sentAt > newest->sentAt || (packet->sentAt == newest->sentAt && packet->sequence > newest->sequence))
+      {
+         continue;
+      }
+      
+      /* The lowest hole tells the congestion controller, it ignores the rest of the same recovery anyway */
+      if (!isLoss)
+      {
+         congestionLoss(&(session->cc), sequence, session->currentPacket, FALSE, now);
+         isLoss = TRUE;
+      }
+      queueResend(session, sequence);
+   }
 }
 
-/* Send either the next data packet or a repeat packet from a received SREJ */
-int sendData(int socketNum, Connection *client, Packet *packets, uint32_t *currentPacket, int *currentRR, int *currentSREJ, int windowSize, uint32_t *currentPreparePacket, int *donePreparing)
+/* Resend a batch of lost packets, returns how many the socket took (-1 if the file shrank under them) */
+int resendBatch(Session *session, PacketDesc *batch[], int count, int64_t now)
 {
+   int sent = sendPacketBatch(session->socketNum, (struct sockaddr *) &(session->remote), batch, count);
+   int i;
    
-   Packet packet;
-   
-   /* If the packet about to be sent is less than the current RR, update currentPacket */
-   if (*currentPacket < *currentRR)
+   for (i = 0; i < sent; i++)
    {
-      *currentPacket = *currentRR;
+      batch[i]->retransmits++;
+      batch[i]->sentAt = now;
+      session->packetsResent++;
+      session->tokens -= batch[i]->length;
    }
+   return sent;
+}
+
+/* Queue a lost packet to go out again, once however many times it is reported, if it is still in flight */
+void queueResend(Session *session, uint32_t seq)
+{
+   int slot = seq % session->windowSize;
    
-   /* If there is an SREJ to process, grab that particular packet */
-   if (*currentSREJ != -1)
+   if ((int) seq < session->currentRR || seq >= session->currentPacket || ((session->resends[slot / 8] >> (slot % 8)) & 1))
    {
-      packet = packets[(*currentSREJ) % windowSize];
-      *currentSREJ = -1;
+      return;
    }
-   
-   /* If the window is closed */
-   else if ((*currentPacket) - (*currentRR) >= windowSize)
+   session->resends[slot / 8] |= 1 << (slot % 8);
+   if (session->resendCount == 0 || seq < session->resendFrom)
    {
-      return WAIT_FOR_ACK;
+      session->resendFrom = seq;
    }
+   session->resendCount++;
+}
+
+/* Forget the queued packets below end, the client has them or they are about to go out as new data anyway */
+void dropResends(Session *session, uint32_t end)
+{
+   uint32_t sequence;
+   int slot;
    
-   /* If the packet to be sent has not been prepared yet, prepare it, or wait for ACK if the last packet has been stored */
-   else if (*currentPacket >= *currentPreparePacket)
+   for (sequence = session->resendFrom; session->resendCount > 0 && sequence < end; sequence++)
    {
-      if (*donePreparing || ((*currentPreparePacket - *currentRR) >= windowSize))
+      slot = sequence % session->windowSize;
+      if ((session->resends[slot / 8] >> (slot % 8)) & 1)
       {
-         return WAIT_FOR_ACK;
+         session->resends[slot / 8] &= ~(1 << (slot % 8));
+         session->resendCount--;
       }
-      return PREPARE_DATA;
    }
-   else /* Prepare the packet based on the currentPacket */
+   if (end > session->resendFrom)
+   {
+      session->resendFrom = end;
+   }
+}
+
+/* Resend the next batch of queued packets, lowest sequence first */
+int sendResends(Session *session)
+{
+   PacketDesc *batch[SEND_BATCH];
+   uint32_t sequence;
+   int count = 0;
+   int slot;
+   int sent;
+   int i;
+   
+   for (sequence = session->resendFrom; count < session->resendCount && count < SEND_BATCH; sequence++)
    {
-      packet = packets[(*currentPacket) % windowSize];
-      (*currentPacket)++;
+      slot = sequence % session->windowSize;
+      if ((session->resends[slot / 8] >> (slot % 8)) & 1)
+      {
+         batch[count++] = &(session->packets[slot]);
+      }
    }
    
-   /* Send the packet */
-   sendPacket(socketNum, packet.sequence, packet.header.flag, (struct sockaddr *) &(client->remote), packet.buf, packet.header.length);
+   /* Socket buffer is full, they stay queued and go on the next run */
+   if ((sent = resendBatch(session, batch, count, getTimeUsec())) == 0)
+   {
+      markRunnable(session);
+      return SEND_DATA;
+   }
+   if (sent < 0)
+   {
+      return fileShrank();
+   }
+   for (i = 0; i < sent; i++)
+   {
+      slot = batch[i]->sequence % session->windowSize;
+      session->resends[slot / 8] &= ~(1 << (slot % 8));
+   }
+   session->resendCount -= sent;
+   session->resendFrom = batch[sent - 1]->sequence + 1;
    
-   /* If it is the last packet, wait 1 sec for ACK */
-   if (packet.header.flag == FLAG_10_FINAL_DATA)
+   /* The last packet is the highest, nothing new is left behind it */
+   if (batch[sent - 1]->flag == FLAG_10_FINAL_DATA)
    {
       return WAIT_FOR_ACK;
    }
-   
-   /* otherwise, check for ACK */
    return CHECK_FOR_ACK;
 }
 
-/* Process and incoming RR or SREJ packet */
-int processAck(int socketNum, struct sockaddr_in6 server, int *currentRR, int *currentSREJ, int *donePreparing, int *tries)
+/* The mapped file got shorter than the packets already cut from it, so they cannot be sent (read() would
+   have seen the end of the file early), end the session */
+int fileShrank()
 {
-   /* Make sure the amount of tries for waiting for ACK's is reset to 10 */
-   *tries = 10;
-   uint8_t buf[MAX_BUF];
-   uint8_t *bufPtr = buf;
-   uint32_t seq;
-   
-   /* Receive the packet */
-   int len = receivePacket(socketNum, bufPtr, (struct sockaddr *) &server, sizeof(Header) + sizeof(uint32_t));
-   if (len == 0)
+   fprintf(stderr, "File shrank while it was being sent, ending session...\n");
+   return DONE;
+}
+
+/* Look for an RR or SREJ packet without waiting, otherwise goto SEND_DATA state */
+int checkForAck(Session *session)
+{
+   /* Process ACK and proceed based on the contents */
+   if (session->isReadable)
    {
-      return PREPARE_DATA;
+      return PROCESS_ACK;
    }
    
-   /* Grab contents from the packet */
-   Header header;
-   memcpy(&header, bufPtr, sizeof(Header));
-   bufPtr += sizeof(Header);
-   memcpy(&seq, bufPtr, sizeof(seq));  
-   seq = ntohl(seq);
-   
-   /* If the packet is RR, make sure to update the current packet, if it is the last one, end the thread */
-   if (header.flag == FLAG_5_RR)
+   /* Prepare and send another packet */
+   return PREPARE_DATA;
+}
+
+/* Wait one RTO for an RR or SREJ packet, otherwise resend lowest packet in window */
+int waitForAck(Session *session)
+{
+   int dataState = DATA_NOT_READY;
+   dataState = waitOnSession(session, session->rto); 
+
+   switch(dataState)
    {
-      if (*donePreparing && seq > lastPacket)
+      case DATA_NOT_READY: /* Resend the lowest packet in the window again, backing off the RTO, and wait for a response */
+      {
+         session->rto = session->rto * 2 < RTO_MAX_USEC ? session->rto * 2 : RTO_MAX_USEC;
+         congestionLoss(&(session->cc), session->currentRR, session->currentPacket, TRUE, getTimeUsec());
+         
+         /* Whatever was in flight behind it is presumed lost too (the client cannot report holes it never saw
+            anything past), so the rest of the window goes out again as the congestion window reopens and only
+            the lowest packet is left queued */
+         dropResends(session, session->currentPacket);
+         session->currentPacket = session->currentRR + 1;
+         queueResend(session, session->currentRR);
+         return SEND_DATA;
+      }
+      case DATA_READY: /* Process the incoming ACK */
+      {
+         return PROCESS_ACK;
+      }
+      case DATA_BLOCKED: /* Keep waiting */
       {
+         return WAIT_FOR_ACK;
+      }
+      default:
+      {
+         fprintf(stderr, "Something went wrong in waitForAck()\n");
          return DONE;
       }
-      *currentRR = seq;
-      return CHECK_FOR_ACK;
-   }
-   
-   /* If the packet is SREJ, set SREJ variable so it can be sent again immediately */
-   else if (header.flag == FLAG_6_SREJ)
-   {
-      *currentSREJ = seq;
-      return SEND_DATA;
-   }
-   else /* Otherwise, the packet should be ignored */
-   {
-      return PREPARE_DATA;
    }
 }
 
-/* Wait 0 seconds for an RR or SREJ packet, otherwise goto SEND_DATA state */
-int checkForAck(int socketNum, struct sockaddr_in6 server, int *tries, int seconds)
+/* Wait until the pacing bucket holds the next packet, an RR or SREJ that arrives first is processed */
+int waitToSend(Session *session)
 {
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, seconds, tries); 
-   *tries = 1;
-   
+   PacketDesc *packet = &(session->packets[session->currentPacket % session->windowSize]);
+   dataState = waitOnSession(session, paceDelay(session, packet->length));
+
    switch(dataState)
    {
-      case DATA_NOT_READY: /* Prepare and send another packet */
+      case DATA_NOT_READY: /* The bucket has filled, send */
       {
-         return PREPARE_DATA;
+         return SEND_DATA;
       }
-      case DATA_READY: /* Process ACK and proceed based on the contents */
+      case DATA_READY: /* Process the incoming ACK */
       {
          return PROCESS_ACK;
       }
-      case TRIES_FINISHED: /* This should never happen in this case, but here just in case */
+      case DATA_BLOCKED: /* Keep waiting */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
-         exit(-1);
+         return WAIT_TO_SEND;
       }
       default:
       {
-         fprintf(stderr, "Something went wrong in checkForAck() \n");
-         exit(-1);
+         fprintf(stderr, "Something went wrong in waitToSend()\n");
+         return DONE;
       }
    }
 }
 
-/* Wait 1 second for an RR or SREJ packet, otherwise resend lowest packet in window (10 tries) */
-int waitForAck(int socketNum, struct sockaddr_in6 server, int *tries, int seconds, int *currentRR, int *currentPacket, Packet *packets, int windowSize)
+/* Give the read-ahead a moment to bring in the next chunk, an RR or SREJ that arrives first is processed */
+int waitForFile(Session *session)
 {
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, seconds, tries); 
+   dataState = waitOnSession(session, READ_AHEAD_WAIT_USEC);
 
    switch(dataState)
    {
-      case DATA_NOT_READY: /* Resend the lowest packet in the window again and wait for a response */
+      case DATA_NOT_READY: /* Look at the read-ahead again */
       {
-         Packet packet = packets[*currentRR % windowSize];
-         uint32_t seq = packet.sequence;
-         sendPacket(socketNum, seq, packet.header.flag, (struct sockaddr *) &server, packet.buf, packet.header.length);
-         return WAIT_FOR_ACK;
+         return PREPARE_DATA;
       }
       case DATA_READY: /* Process the incoming ACK */
       {
          return PROCESS_ACK;
       }
-      case TRIES_FINISHED: /* If trying to get data for 10 tries, exit */
+      case DATA_BLOCKED: /* Keep waiting */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
-         exit(-1);
+         return WAIT_FOR_FILE;
       }
       default:
       {
-         fprintf(stderr, "Something went wrong in waitForAck()\n");
-         exit(-1);
+         fprintf(stderr, "Something went wrong in waitForFile()\n");
+         return DONE;
       }
    }
 }
 
+/* Refill the session's token bucket at the pacing rate (the controller's, held under the session cap)
+   and return how many microseconds until it holds a packet of this size, 0 to send now */
+int64_t paceDelay(Session *session, int size)
+{
+   int64_t now = getTimeUsec();
+   int64_t rate = congestionPacingRate(&(session->cc), session->srtt, size);
+   double burst;
+   
+   if (session->rateCap > 0 && (rate == 0 || rate > session->rateCap))
+   {
+      rate = session->rateCap;
+   }
+   session->pacingRate = rate;
+   if (rate == 0)
+   {
+      return 0;
+   }
+   
+   burst = (double) rate * PACING_BURST_USEC / 1000000;
+   if (burst < PACING_MIN_BURST * size)
+   {
+      burst = PACING_MIN_BURST * size;
+   }
+   session->tokens += (double) rate * (now - session->tokensAt) / 1000000;
+   session->tokensAt = now;
+   if (session->tokens > burst)
+   {
+      session->tokens = burst;
+   }
+   
+   if (session->tokens >= size)
+   {
+      return 0;
+   }
+   return (int64_t) ((size - session->tokens) * 1000000 / rate) + 1;
+}
+
+/* Fold an RTT sample into the smoothed RTT and variance (Jacobson/Karels) and derive the RTO from them */
+void updateRto(Session *session, int64_t sample)
+{
+   if (session->rttSamples == 0)
+   {
+      session->srtt = sample;
+      session->rttvar = sample / 2;
+   }
+   else
+   {
+      int64_t error = session->srtt > sample ? session->srtt - sample : sample - session->srtt;
+      session->rttvar = (3 * session->rttvar + error) / 4;
+      session->srtt = (7 * session->srtt + sample) / 8;
+   }
+   session->rttSamples++;
+   
+   /* RTO = SRTT + 4 * RTTVAR, which also undoes any backoff */
+   session->rto = session->srtt + (4 * session->rttvar > 1 ? 4 * session->rttvar : 1);
+   if (session->rto < RTO_MIN_USEC)
+   {
+      session->rto = RTO_MIN_USEC;
+   }
+   if (session->rto > RTO_MAX_USEC)
+   {
+      session->rto = RTO_MAX_USEC;
+   }
+}
+
 /* Wait for the filename packet from the client */
-int waitOnFilename(int socketNum, struct sockaddr_in6 server, int *tries)
+int waitOnFilename(Session *session)
 {   
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, 10, tries); 
+   dataState = waitOnSession(session, CONTROL_TIMEOUT_USEC); 
 
    switch(dataState)
    {
@@ -433,24 +1516,23 @@ int waitOnFilename(int socketNum, struct sockaddr_in6 server, int *tries)
       {
          return GET_FILENAME;
       }
-      case TRIES_FINISHED: /* If trying to get data for 10 tries, exit */
+      case DATA_BLOCKED: /* Keep waiting */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
-         exit(-1);
+         return WAIT_ON_FILENAME;
       }
       default:
       {
          fprintf(stderr, "Something went wrong in waitOnFilename() \n");
-         exit(-1);
+         return DONE;
       }
    }
 }
 
 /* Wait for the client to disconnect, resend filename if this times out */
-int waitOnFilenameResponse(int socketNum, Connection *client, int *tries)
+int waitOnFilenameResponse(Session *session)
 {   
    int dataState = DATA_NOT_READY;
-   dataState = safeSelect(socketNum, 1, tries); 
+   dataState = waitOnSession(session, CONTROL_TIMEOUT_USEC); 
 
    switch(dataState)
    {
@@ -462,31 +1544,24 @@ int waitOnFilenameResponse(int socketNum, Connection *client, int *tries)
       {
          return GET_FILENAME_RESPONSE;
       }
-      case TRIES_FINISHED: /* If trying to get data for 10 tries, exit */
+      case DATA_BLOCKED: /* Keep waiting */
       {
-         fprintf(stderr, "Tries finished! Exiting... \n");
-         exit(-1);
+         return WAIT_ON_FILENAME_RESPONSE;
       }
       default:
       {
          fprintf(stderr, "Something went wrong in waitOnFilenameResponse() \n");
-         exit(-1);
+         return DONE;
       }
    }
 }
 
-/* Process the first packet received from parent process */
-int processSetupPacket(uint8_t *buf, int32_t len, Connection *client, int *windowSize, int *bufferSize, Packet **packets)
+/* Process the first packet received from a client */
+int processSetupPacket(Session *session, int32_t len)
 {
    Header header;
-   uint8_t *bufPtr = buf;
-   
-   /* Get client socket */
-   if ((client->socketNum = socket(AF_INET6, SOCK_DGRAM, 0)) < 0)
-   {
-      perror("socket");
-      exit(-1);
-   }
+   uint8_t *bufPtr = session->buf;
+   const CongestionOps *ops = findCongestion(CC_DEFAULT);
    
    /* Grab the header */
    memcpy(&header, bufPtr, sizeof(Header));
@@ -495,39 +1570,66 @@ int processSetupPacket(uint8_t *buf, int32_t len, Connection *client, int *windo
    /* First packet should have flag 1, otherwise something funky is going on */
    if (header.flag != FLAG_1_SETUP)
    {
-      fprintf(stderr, "Invalid first packet! Exiting... \n");
-      exit(-1);
+      fprintf(stderr, "Invalid first packet! Ending session... \n");
+      return DONE;
    }
    
    /* Grab the window size and buffer size */
-   memcpy(windowSize, bufPtr, sizeof(*bufferSize));
-   bufPtr += sizeof(*windowSize);
-   memcpy(bufferSize, bufPtr, sizeof(*bufferSize));
+   memcpy(&(session->windowSize), bufPtr, sizeof(session->windowSize));
+   bufPtr += sizeof(session->windowSize);
+   memcpy(&(session->bufferSize), bufPtr, sizeof(session->bufferSize));
+   bufPtr += sizeof(session->bufferSize);
+   
+   /* Ignore setup packets asking for a window or buffer that cannot be served */
+   if (session->windowSize <= 0 || session->bufferSize <= 0 || session->bufferSize > MAX_DATA_BUF)
+   {
+      fprintf(stderr, "Invalid setup packet! Ending session... \n");
+      return DONE;
+   }
+   
+   /* The client may name a congestion controller after the sizes, unknown names get the default */
+   if (len > bufPtr - session->buf)
+   {
+      char name[CC_NAME_LEN];
+      int nameLen = len - (bufPtr - session->buf) < CC_NAME_LEN ? len - (bufPtr - session->buf) : CC_NAME_LEN;
+      memcpy(name, bufPtr, nameLen);
+      name[nameLen - 1] = '\0';
+      if (findCongestion(name) != NULL)
+      {
+         ops = findCongestion(name);
+      }
+   }
+   initCongestion(&(session->cc), ops, session->windowSize);
    
-   /* Initialize the packets based on the window size */
-   if((*packets = calloc(*windowSize, sizeof(Packet))) < 0)
+   /* Initialize the window's packet descriptors, their data goes in the payload arena or stays in the mapped file */
+   if ((session->packets = calloc(session->windowSize, sizeof(PacketDesc))) == NULL)
    {
       perror("calloc");
-      exit(-1);
+      return DONE;
+   }
+   
+   /* One bit per slot for the packets queued to go out again */
+   if ((session->resends = calloc((session->windowSize + 7) / 8, 1)) == NULL)
+   {
+      perror("calloc");
+      return DONE;
    }
    
    return SEND_SETUP_RESPONSE;
 }
 
 /* Get and process the filename packet that arrived */
-int processFilename(int socketNum, uint8_t *buf, int *datafile, Connection *client, int *isErr, int *tries)
+int processFilename(Session *session)
 {
-   /* Reset tries to 10 because data arrived! */
-   *tries = 10;
-   int len = receivePacket(client->socketNum, buf, (struct sockaddr *) &(client->remote), MAX_BUF);
-   if (len == 0) /* If there is no packe to process (most likely due to a bad checksum), continue to wait for filename */
+   int len = receiveSessionPacket(session, session->buf, MAX_BUF);
+   if (len < 0) /* Nothing was actually delivered, go back to waiting */
    {
       return WAIT_ON_FILENAME;
    }
    
    /* Parse filename packet */
    Header header;
-   uint8_t *bufPtr = buf;
+   uint8_t *bufPtr = session->buf;
    char filename[MAX_BUF];
    memcpy(&header, bufPtr, sizeof(Header));
    bufPtr += sizeof(Header);
@@ -537,38 +1639,106 @@ int processFilename(int socketNum, uint8_t *buf, int *datafile, Connection *clie
    int fd;
    if ((fd = open(filename, O_RDONLY)) < 0)
    {
-      *isErr = 1;
+      session->isErr = errno;
       return SEND_FILENAME_RESPONSE;
    }
    else
    {
-      *datafile = fd;
+      session->file = fd;
+      mapFile(session);
+      sendFileSize(session);
+      
+      /* An empty regular file needs no read-ahead or buffers, like it needs no mapping */
+      if (session->fileSize == 0)
+      {
+         return PREPARE_DATA;
+      }
+      
+      /* A mapped file is faulted in ahead of the send cursor so a cold file never stalls the event loop, pipes,
+         devices and the like are read ahead in big chunks off the event loop instead */
+      if (session->map != NULL)
+      {
+         session->readAhead = startMapAhead(session->map, session->mapLen);
+      }
+      else
+      {
+         session->readAhead = startReadAhead(session->file, session->bufferSize);
+         
+         /* Only data that is not mapped needs a place in memory, one packet of the negotiated size per slot */
+         if ((session->payloads = malloc((size_t) session->windowSize * session->bufferSize)) == NULL)
+         {
+            perror("malloc");
+            return DONE;
+         }
+      }
       return PREPARE_DATA;
    }
 }
 
+/* Map a regular file once so packets are views into it, anything that cannot be mapped is read as it goes */
+void mapFile(Session *session)
+{
+   struct stat info;
+   void *map;
+   
+   if (fstat(session->file, &info) < 0 || !S_ISREG(info.st_mode))
+   {
+      return;
+   }
+   
+   /* A regular file's size is known up front, and with it the last packet */
+   session->fileSize = info.st_size;
+   session->lastPacket = info.st_size == 0 ? 0 : (info.st_size - 1) / session->bufferSize;
+   if (info.st_size == 0)
+   {
+      return;
+   }
+   if ((map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, session->file, 0)) == MAP_FAILED)
+   {
+      return;
+   }
+   
+   /* The file is sent front to back, the read-ahead brings it in a chunk at a time */
+   madvise(map, info.st_size, MADV_SEQUENTIAL);
+   session->map = map;
+   session->mapLen = info.st_size;
+   session->mapOffset = 0;
+}
+
+/* Tell the client how big the file is, so it can make room for it. Nothing is sent when the size is not
+   known (a pipe, say), the client finds the end from the final data packet either way */
+void sendFileSize(Session *session)
+{
+   uint64_t size = htobe64(session->fileSize);
+   
+   if (session->fileSize >= 0)
+   {
+      sendPacket(session->socketNum, 0, FLAG_11_FILE_SIZE, (struct sockaddr *) &(session->remote), (uint8_t *) &size, sizeof(size));
+   }
+}
+
 /* Send the errno response to the client for a bad filename */
-int sendFilenameResponse(int socketNum, Connection *client, int *isErr)
+int sendFilenameResponse(Session *session)
 {
    char errBuf[MAX_BUF];
-   memcpy(errBuf, &errno, sizeof(errno));
-   sendPacket(socketNum, 0, FLAG_8_BAD_FILENAME, (struct sockaddr *) &(client->remote), errBuf, sizeof(errno));
+   memcpy(errBuf, &(session->isErr), sizeof(session->isErr));
+   sendPacket(session->socketNum, 0, FLAG_8_BAD_FILENAME, (struct sockaddr *) &(session->remote), errBuf, sizeof(session->isErr));
    return WAIT_ON_FILENAME_RESPONSE;
 }
 
 /* Get the response from the client about the filename (presumably to end connection) */
-int processFilenameResponse(uint8_t *buf, Connection *client)
+int processFilenameResponse(Session *session)
 {
    /* Grab the packet, resend the filename response if it is a bad packet */
-   int len = receivePacket(client->socketNum, buf, (struct sockaddr *) &(client->remote), MAX_BUF);
-   if (len == 0)
+   int len = receiveSessionPacket(session, session->buf, MAX_BUF);
+   if (len < 0) /* Nothing was actually delivered, go back to waiting */
    {
-      return SEND_FILENAME_RESPONSE;
+      return WAIT_ON_FILENAME_RESPONSE;
    }
    
    /* Parse filename response packet */
    Header header;
-   uint8_t *bufPtr = buf;
+   uint8_t *bufPtr = session->buf;
    memcpy(&header, bufPtr, sizeof(Header));
    bufPtr += sizeof(Header);
    
@@ -587,28 +1757,62 @@ int checkArgs(int argc, char *argv[])
 {
 	int portNumber = 0;
 
-   /* There must be either 2 or 3 args */
-	if (argc > 3 || argc < 2)
+   /* There must be between 2 and 6 args */
+	if (argc > 6 || argc < 2)
 	{
-		fprintf(stderr, "Usage %s [error percent] [optional port number]\n", argv[0]);
+		fprintf(stderr, "Usage %s [error percent] [optional port number] [optional worker count] [optional threads|prefork] [optional session rate cap Mb/s]\n", argv[0]);
 		exit(-1);
 	}
 	
    /* if 3 args, 3rd is the port number */
-	if (argc == 3)
+	if (argc >= 3)
 	{
 		portNumber = atoi(argv[2]);
 	}
    
-   /* Grab the percent and try to convert it to a float */
+   /* if 4 args, 4th is the number of workers */
+   if (argc >= 4)
+   {
+      numWorkers = atoi(argv[3]);
+      if (numWorkers < 1 || numWorkers > MAX_THREADS)
+      {
+         fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_THREADS);
+         exit(-1);
+      }
+   }
+   
+   /* if 5 args, 5th picks worker threads (default) or a pre-forked pool of worker processes */
+   if (argc >= 5)
+   {
+      if (strcmp(argv[4], "prefork") == 0)
+      {
+         isPrefork = TRUE;
+      }
+      else if (strcmp(argv[4], "threads") != 0)
+      {
+         fprintf(stderr, "Worker model must be threads or prefork\n");
+         exit(-1);
+      }
+   }
+   
+   /* if 6 args, 6th caps how fast each session sends, 0 leaves it to the congestion controller */
+   if (argc == 6)
+   {
+      if (atof(argv[5]) < 0)
+      {
+         fprintf(stderr, "Session rate cap must be at least 0\n");
+         exit(-1);
+      }
+      rateCap = (int64_t) (atof(argv[5]) * 1000000 / 8);
+   }
+   
+   /* Grab the percent and try to convert it to a float, 0 turns off error injection */
    errorPercent = atof(argv[1]);
-   if (errorPercent <= 0 || errorPercent >= 1)
+   if (errorPercent < 0 || errorPercent >= 1)
    {
-      fprintf(stderr, "Error percent must be between 0 and 1\n");
+      fprintf(stderr, "Error percent must be at least 0 and less than 1\n");
       exit(-1);
    }
 	
 	return portNumber;
-}
-
-
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+// Per-worker table routing datagrams on the shared server socket to their session
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "networks.h"
+#include "sessionTable.h"
+
+/* The address belongs to the session's client when the address and port match */
+static int sameAddress(Session *session, struct sockaddr_in6 *addr)
+{
+   return session->remote.sin6_port == addr->sin6_port &&
+      memcmp(&(session->remote.sin6_addr), &(addr->sin6_addr), sizeof(addr->sin6_addr)) == 0;
+}
+
+/* Slot holding the session for the address, or the empty slot where it would go */
+static int findSlot(SessionTable *table, struct sockaddr_in6 *addr)
+{
+   int mask = table->capacity - 1;
+   int slot = hashAddress(addr) & mask;
+
+   while (table->slots[slot] != NULL && !sameAddress(table->slots[slot], addr))
+   {
+      slot = (slot + 1) & mask;
+   }
+   return slot;
+}
+
+/* Rehash every session into a table twice the size */
+static void growTable(SessionTable *table)
+{
+   Session **oldSlots = table->slots;
+   int oldCapacity = table->capacity;
+   int i;
+
+   table->capacity = oldCapacity ? 2 * oldCapacity : SESSION_TABLE_MIN;
+   if ((table->slots = calloc(table->capacity, sizeof(Session *))) == NULL)
+   {
+      perror("calloc");
+      exit(-1);
+   }
+
+   for (i = 0; i < oldCapacity; i++)
+   {
+      if (oldSlots[i] != NULL)
+      {
+         table->slots[findSlot(table, &(oldSlots[i]->remote))] = oldSlots[i];
+      }
+   }
+   free(oldSlots);
+}
+
+/* Look up the session for a client address, NULL if the client has none */
+Session *findSession(SessionTable *table, struct sockaddr_in6 *addr)
+{
+   if (table->count == 0)
+   {
+      return NULL;
+   }
+   return table->slots[findSlot(table, addr)];
+}
+
+/* Add a session under its client address (the address must not already have one) */
+void insertSession(SessionTable *table, Session *session)
+{
+   if (2 * (table->count + 1) > table->capacity)
+   {
+      growTable(table);
+   }
+   table->slots[findSlot(table, &(session->remote))] = session;
+   table->count++;
+}
+
+/* Remove a session, pulling later entries of its probe run back into the hole */
+void deleteSession(SessionTable *table, Session *session)
+{
+   int mask = table->capacity - 1;
+   int hole;
+   int slot;
+
+   if (table->count == 0 || table->slots[hole = findSlot(table, &(session->remote))] != session)
+   {
+      return;
+   }
+   table->slots[hole] = NULL;
+   table->count--;
+
+   /* An entry can fill the hole only if its home slot is not between the hole and where it sits */
+   for (slot = (hole + 1) & mask; table->slots[slot] != NULL; slot = (slot + 1) & mask)
+   {
+      int home = hashAddress(&(table->slots[slot]->remote)) & mask;
+      if (((slot - home) & mask) >= ((slot - hole) & mask))
+      {
+         table->slots[hole] = table->slots[slot];
+         table->slots[slot] = NULL;
+         hole = slot;
+      }
+   }
+}
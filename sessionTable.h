@@ -0,0 +1,18 @@
+// Per-worker table routing datagrams on the shared server socket to their session
+//
+// Open addressing with linear probing, keyed on the client's address and port.
+// The table doubles before it is half full and deletes by shifting the rest of
+// the probe run back, so lookups never have to step over tombstones.
+
+#ifndef __SESSION_TABLE_H__
+#define __SESSION_TABLE_H__
+
+#include "networks.h"
+
+#define SESSION_TABLE_MIN 64
+
+Session *findSession(SessionTable *table, struct sockaddr_in6 *addr);
+void insertSession(SessionTable *table, Session *session);
+void deleteSession(SessionTable *table, Session *session);
+
+#endif
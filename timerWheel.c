@@ -0,0 +1,241 @@
+// Hierarchical timer wheel with microsecond ticks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "networks.h"
+#include "timerWheel.h"
+
+/* Put an unarmed timer in the slot its expiry falls into, relative to the wheel's current tick */
+static void placeTimer(TimerWheel *wheel, Timer *timer)
+{
+   int64_t place = timer->expires;
+   int64_t delta;
+   int level = 0;
+   Timer **slot;
+
+   /* Anything already due fires on the next tick */
+   if (place < wheel->current)
+   {
+      place = wheel->current;
+   }
+   delta = place - wheel->current;
+
+   while (level < TIMER_LEVELS - 1 && delta >= ((int64_t) 1 << (TIMER_BITS * (level + 1))))
+   {
+      level++;
+   }
+
+   /* Past the top level, park it in the furthest slot and let the cascades bring it down */
+   if (delta >= ((int64_t) 1 << (TIMER_BITS * TIMER_LEVELS)))
+   {
+      place = wheel->current + ((int64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+   }
+
+   slot = &(wheel->slots[level][(place >> (TIMER_BITS * level)) & TIMER_MASK]);
+   timer->level = level;
+   timer->next = *slot;
+   timer->pprev = slot;
+   if (*slot != NULL)
+   {
+      (*slot)->pprev = &(timer->next);
+   }
+   *slot = timer;
+   wheel->counts[level]++;
+}
+
+/* Take a whole slot off the wheel, returning its list of timers */
+static Timer *takeSlot(TimerWheel *wheel, int level, int index)
+{
+   Timer *list = wheel->slots[level][index];
+   Timer *timer;
+
+   wheel->slots[level][index] = NULL;
+   for (timer = list; timer != NULL; timer = timer->next)
+   {
+      timer->pprev = NULL;
+      wheel->counts[level]--;
+   }
+   return list;
+}
+
+/* Level 0 wrapped: move the next slot of each level above down, stopping at the first that did not wrap */
+static void cascade(TimerWheel *wheel)
+{
+   int level;
+   int index;
+   Timer *timer;
+   Timer *next;
+
+   for (level = 1; level < TIMER_LEVELS; level++)
+   {
+      index = (wheel->current >> (TIMER_BITS * level)) & TIMER_MASK;
+      for (timer = takeSlot(wheel, level, index); timer != NULL; timer = next)
+      {
+         next = timer->next;
+         placeTimer(wheel, timer);
+      }
+      if (index != 0)
+      {
+         break;
+      }
+   }
+}
+
+/* Start an empty wheel at the given time */
+void initTimerWheel(TimerWheel *wheel, int64_t now)
+{
+   memset(wheel, 0, sizeof(TimerWheel));
+   wheel->current = now;
+}
+
+/* Set up a timer that calls onExpire (which may be NULL) when it fires */
+void initTimer(Timer *timer, void (*onExpire)(Timer *timer), void *owner)
+{
+   memset(timer, 0, sizeof(Timer));
+   timer->onExpire = onExpire;
+   timer->owner = owner;
+}
+
+/* Arm (or re-arm) a timer to fire at the given time */
+void startTimer(TimerWheel *wheel, Timer *timer, int64_t expires)
+{
+   stopTimer(wheel, timer);
+   timer->expires = expires;
+   placeTimer(wheel, timer);
+}
+
+/* Disarm a timer, it is fine if it was not armed */
+void stopTimer(TimerWheel *wheel, Timer *timer)
+{
+   timer->hasFired = FALSE;
+   if (timer->pprev == NULL)
+   {
+      return;
+   }
+   *(timer->pprev) = timer->next;
+   if (timer->next != NULL)
+   {
+      timer->next->pprev = timer->pprev;
+   }
+   timer->pprev = NULL;
+
+   /* Timers about to fire are already off the wheel's counts */
+   if (timer->level < TIMER_LEVELS)
+   {
+      wheel->counts[timer->level]--;
+   }
+}
+
+/* TRUE while the timer is waiting to fire */
+int timerArmed(Timer *timer)
+{
+   return timer->pprev != NULL;
+}
+
+/* Fire every timer due at or before now */
+void advanceTimers(TimerWheel *wheel, int64_t now)
+{
+   int level;
+   int64_t span;
+   Timer *timer;
+   Timer *fired;
+
+   while (wheel->current <= now)
+   {
+      /* Nothing due on the lowest levels, skip straight to where the next level cascades */
+      for (level = 0; level < TIMER_LEVELS && wheel->counts[level] == 0; level++);
+      if (level == TIMER_LEVELS)
+      {
+         wheel->current = now + 1;
+         break;
+      }
+      if (level > 0)
+      {
+         span = (int64_t) 1 << (TIMER_BITS * level);
+         if (((wheel->current + span - 1) & ~(span - 1)) > now)
+         {
+            wheel->current = now + 1;
+            break;
+         }
+         wheel->current = (wheel->current + span - 1) & ~(span - 1);
+      }
+
+      if ((wheel->current & TIMER_MASK) == 0)
+      {
+         cascade(wheel);
+      }
+
+      /* Fire the slot from a list of its own, so callbacks can stop or re-arm any timer (timers armed
+         for right now land on the next tick, not the slot being fired) */
+      fired = wheel->slots[0][wheel->current & TIMER_MASK];
+      wheel->slots[0][wheel->current & TIMER_MASK] = NULL;
+      for (timer = fired; timer != NULL; timer = timer->next)
+      {
+         timer->level = TIMER_LEVELS;
+         wheel->counts[0]--;
+      }
+      if (fired != NULL)
+      {
+         fired->pprev = &fired;
+      }
+      wheel->current++;
+
+      while ((timer = fired) != NULL)
+      {
+         fired = timer->next;
+         if (fired != NULL)
+         {
+            fired->pprev = &fired;
+         }
+         timer->pprev = NULL;
+         timer->hasFired = TRUE;
+         if (timer->onExpire != NULL)
+         {
+            timer->onExpire(timer);
+         }
+      }
+   }
+}
+
+/* Earliest time the wheel needs advancing (a timer fires or a level cascades), -1 if nothing is armed */
+int64_t nextTimerUsec(TimerWheel *wheel)
+{
+   int64_t earliest = -1;
+   int64_t base;
+   int level;
+   int offset;
+
+   for (offset = 0; wheel->counts[0] > 0 && offset < TIMER_SLOTS; offset++)
+   {
+      if (wheel->slots[0][(wheel->current + offset) & TIMER_MASK] != NULL)
+      {
+         return wheel->current + offset;
+      }
+   }
+
+   for (level = 1; level < TIMER_LEVELS; level++)
+   {
+      if (wheel->counts[level] == 0)
+      {
+         continue;
+      }
+      /* The slot for the current digit is still pending only if the wheel sits right on its cascade */
+      base = wheel->current >> (TIMER_BITS * level);
+      offset = (wheel->current & (((int64_t) 1 << (TIMER_BITS * level)) - 1)) == 0 ? 0 : 1;
+      for (; offset <= TIMER_SLOTS; offset++)
+      {
+         if (wheel->slots[level][(base + offset) & TIMER_MASK] != NULL)
+         {
+            int64_t when = (base + offset) << (TIMER_BITS * level);
+            if (earliest < 0 || when < earliest)
+            {
+               earliest = when;
+            }
+            break;
+         }
+      }
+   }
+   return earliest;
+}
@@ -0,0 +1,42 @@
+// Hierarchical timer wheel with microsecond ticks
+//
+// Level 0 holds timers due within the next 64 ticks, each level above covers
+// 64 times the span of the one below. When a level wraps, the next slot of the
+// level above is cascaded down, so arming, stopping and firing a timer are all
+// O(1). Times are absolute microseconds from getTimeUsec().
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 5
+
+typedef struct timer {
+   struct timer *next;
+   struct timer **pprev;
+   int64_t expires;
+   int level;
+   int hasFired;
+   void (*onExpire)(struct timer *timer);
+   void *owner;
+} Timer;
+
+typedef struct timerWheel {
+   int64_t current;
+   int counts[TIMER_LEVELS];
+   Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void initTimerWheel(TimerWheel *wheel, int64_t now);
+void initTimer(Timer *timer, void (*onExpire)(Timer *timer), void *owner);
+void startTimer(TimerWheel *wheel, Timer *timer, int64_t expires);
+void stopTimer(TimerWheel *wheel, Timer *timer);
+int timerArmed(Timer *timer);
+void advanceTimers(TimerWheel *wheel, int64_t now);
+int64_t nextTimerUsec(TimerWheel *wheel);
+
+#endif